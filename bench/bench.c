@@ -0,0 +1,566 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge.h"
+#include "threads.h"
+#include "timer.h"
+
+// Measures round trips through bridge_call against the reference children next to this executable.
+//
+//   bridge_bench [--format=text|csv|json] [--iterations=N] [--filter=NAME]
+//
+// Every case is preceded by a few calls that are not measured, so the numbers do not include starting the child.
+
+#define MAX_WIDTH 7680
+#define MAX_HEIGHT 4320
+#define WARMUP_CALLS 3
+// Large cases are cut short once they have moved this many bytes.
+#define BYTES_PER_CASE ((size_t)1024 * 1024 * 1024)
+#define MIN_ITERATIONS 10
+// Work of the sleep child in the threads case, long enough for calls on different instances to overlap.
+#define THREADS_WORK_US 100
+#define MAX_THREADS 8
+
+enum format {
+  FORMAT_TEXT,
+  FORMAT_CSV,
+  FORMAT_JSON,
+};
+
+struct options {
+  enum format format;
+  size_t iterations;
+  char const *filter;
+};
+
+struct result {
+  char const *name;
+  char const *mode;
+  size_t bytes;
+  int32_t width;
+  int32_t height;
+  uint32_t work_us;
+  // Threads calling at the same time, calls_per_s is the sum over all of them.
+  size_t threads;
+  size_t iterations;
+  double mean_us;
+  double p50_us;
+  double p90_us;
+  double p99_us;
+  double p999_us;
+  double max_us;
+  double mb_per_s;
+  double calls_per_s;
+};
+
+static char g_dir[1024];
+static struct options g_options = {FORMAT_TEXT, 1000, NULL};
+static size_t g_results = 0;
+
+static void child_path(char *const dest, size_t const size, char const *const name) {
+#ifdef _WIN32
+  // bridge_call takes a command line, so quote the path in case it has spaces.
+  snprintf(dest, size, "\"%sbench_%s.exe\"", g_dir, name);
+#else
+  snprintf(dest, size, "%sbench_%s", g_dir, name);
+#endif
+}
+
+static int compare_u64(void const *const a, void const *const b) {
+  uint64_t const x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank on sorted samples.
+static double percentile_us(uint64_t const *const sorted, size_t const n, double const p) {
+  size_t rank = (size_t)(p * (double)n + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+  return (double)sorted[(rank > n ? n : rank) - 1] / 1000.0;
+}
+
+static size_t iterations_for(size_t const bytes) {
+  size_t n = g_options.iterations;
+  if (bytes > 0 && n * bytes > BYTES_PER_CASE) {
+    n = BYTES_PER_CASE / bytes;
+  }
+  return n < MIN_ITERATIONS ? MIN_ITERATIONS : n;
+}
+
+static void print_result(struct result const *const r) {
+  switch (g_options.format) {
+  case FORMAT_TEXT:
+    if (g_results == 0) {
+      printf("%-8s %-14s %11s %11s %7s %3s %6s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+             "case",
+             "mode",
+             "bytes",
+             "frame",
+             "work",
+             "thr",
+             "n",
+             "mean(us)",
+             "p50",
+             "p90",
+             "p99",
+             "p99.9",
+             "max",
+             "MB/s",
+             "calls/s");
+    }
+    char frame[32] = "-";
+    if (r->width) {
+      snprintf(frame, sizeof(frame), "%dx%d", r->width, r->height);
+    }
+    printf("%-8s %-14s %11zu %11s %7u %3zu %6zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.0f\n",
+           r->name,
+           r->mode,
+           r->bytes,
+           frame,
+           r->work_us,
+           r->threads,
+           r->iterations,
+           r->mean_us,
+           r->p50_us,
+           r->p90_us,
+           r->p99_us,
+           r->p999_us,
+           r->max_us,
+           r->mb_per_s,
+           r->calls_per_s);
+    break;
+  case FORMAT_CSV:
+    if (g_results == 0) {
+      printf("case,mode,bytes,width,height,work_us,threads,iterations,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,"
+             "mb_per_s,calls_per_s\n");
+    }
+    printf("%s,%s,%zu,%d,%d,%u,%zu,%zu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+           r->name,
+           r->mode,
+           r->bytes,
+           r->width,
+           r->height,
+           r->work_us,
+           r->threads,
+           r->iterations,
+           r->mean_us,
+           r->p50_us,
+           r->p90_us,
+           r->p99_us,
+           r->p999_us,
+           r->max_us,
+           r->mb_per_s,
+           r->calls_per_s);
+    break;
+  case FORMAT_JSON:
+    printf("%s\n    {\"case\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, \"width\": %d, \"height\": %d, \"work_us\": %u, "
+           "\"threads\": %zu, \"iterations\": %zu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+           "\"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, \"mb_per_s\": %.3f, \"calls_per_s\": %.3f}",
+           g_results == 0 ? "" : ",",
+           r->name,
+           r->mode,
+           r->bytes,
+           r->width,
+           r->height,
+           r->work_us,
+           r->threads,
+           r->iterations,
+           r->mean_us,
+           r->p50_us,
+           r->p90_us,
+           r->p99_us,
+           r->p999_us,
+           r->max_us,
+           r->mb_per_s,
+           r->calls_per_s);
+    break;
+  }
+  fflush(stdout);
+  ++g_results;
+}
+
+// Fills the timing fields of r from n round trips that took wall_ns in total, sorts samples.
+static void summarize(struct result *const r, uint64_t *const samples, size_t const n, uint64_t const wall_ns) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += samples[i];
+  }
+  qsort(samples, n, sizeof(uint64_t), compare_u64);
+  r->iterations = n;
+  r->mean_us = (double)total / (double)n / 1000.0;
+  r->p50_us = percentile_us(samples, n, 0.5);
+  r->p90_us = percentile_us(samples, n, 0.9);
+  r->p99_us = percentile_us(samples, n, 0.99);
+  r->p999_us = percentile_us(samples, n, 0.999);
+  r->max_us = (double)samples[n - 1] / 1000.0;
+  double const wall_s = (double)wall_ns / 1e9;
+  r->mb_per_s = wall_ns ? (double)r->bytes * (double)n / wall_s / (1024.0 * 1024.0) : 0;
+  r->calls_per_s = wall_ns ? (double)n / wall_s : 0;
+}
+
+// Calls the child n times and fills the timing fields of r, returns false on the first error.
+static bool run_case(struct result *const r,
+                     char const *const exe_path,
+                     void const *const buf,
+                     int32_t const len,
+                     struct call_mem *const mem,
+                     size_t const n) {
+  uint64_t *const samples = malloc(n * sizeof(uint64_t));
+  if (!samples) {
+    return false;
+  }
+  for (size_t i = 0; i < WARMUP_CALLS + n; ++i) {
+    void *reply = NULL;
+    int32_t reply_len = 0;
+    uint64_t const start = timer_now_ns();
+    int const err = bridge_call(exe_path, buf, len, mem, 0, &reply, &reply_len);
+    uint64_t const end = timer_now_ns();
+    if (err != ECALL_OK) {
+      fprintf(stderr, "%s: bridge_call failed with %d\n", exe_path, err);
+      free(samples);
+      return false;
+    }
+    bridge_free_reply(reply);
+    if (i >= WARMUP_CALLS) {
+      samples[i - WARMUP_CALLS] = end - start;
+    }
+  }
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += samples[i];
+  }
+  r->threads = 1;
+  summarize(r, samples, n, total);
+  free(samples);
+  return true;
+}
+
+static bool selected(char const *const name) { return !g_options.filter || strcmp(g_options.filter, name) == 0; }
+
+static bool bench_echo(void) {
+  static size_t const sizes[] = {0, 64, 4096, 65536, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024};
+  char exe_path[1100];
+  child_path(exe_path, sizeof(exe_path), "echo");
+  char *const payload = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+  if (!payload) {
+    return false;
+  }
+  for (size_t i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; ++i) {
+    payload[i] = (char)i;
+  }
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    struct result r = {.name = "echo", .mode = "-", .bytes = sizes[i]};
+    ok = run_case(&r, exe_path, payload, (int32_t)sizes[i], NULL, iterations_for(sizes[i]));
+    if (ok) {
+      print_result(&r);
+    }
+  }
+  free(payload);
+  return ok;
+}
+
+static bool bench_frame(void) {
+  static struct {
+    int32_t width;
+    int32_t height;
+  } const frames[] = {
+      {320, 240},
+      {640, 480},
+      {1280, 720},
+      {1920, 1080},
+      {3840, 2160},
+      {7680, 4320},
+  };
+  static struct {
+    char const *name;
+    int32_t mode;
+  } const modes[] = {
+      {"r", MEM_MODE_READ},
+      {"w", MEM_MODE_WRITE},
+      {"rw", MEM_MODE_READ | MEM_MODE_WRITE},
+  };
+  char exe_path[1100];
+  child_path(exe_path, sizeof(exe_path), "invert");
+  uint32_t *const pixels = malloc((size_t)MAX_WIDTH * MAX_HEIGHT * 4);
+  if (!pixels) {
+    return false;
+  }
+  for (size_t i = 0; i < (size_t)MAX_WIDTH * MAX_HEIGHT; ++i) {
+    pixels[i] = (uint32_t)i | UINT32_C(0xff000000);
+  }
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(frames) / sizeof(frames[0]); ++i) {
+    for (size_t j = 0; ok && j < sizeof(modes) / sizeof(modes[0]); ++j) {
+      struct call_mem mem = {
+          .buf = pixels,
+          .mode = modes[j].mode,
+          .width = frames[i].width,
+          .height = frames[i].height,
+          .format = PIXEL_FORMAT_BGRA,
+      };
+      struct result r = {
+          .name = "frame",
+          .mode = modes[j].name,
+          .bytes = (size_t)frames[i].width * (size_t)frames[i].height * 4,
+          .width = frames[i].width,
+          .height = frames[i].height,
+      };
+      ok = run_case(&r, exe_path, NULL, 0, &mem, iterations_for(r.bytes));
+      if (ok) {
+        print_result(&r);
+      }
+    }
+  }
+  free(pixels);
+  return ok;
+}
+
+static bool bench_sleep(void) {
+  static uint32_t const works[] = {0, 10, 100, 1000};
+  char exe_path[1100];
+  child_path(exe_path, sizeof(exe_path), "sleep");
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(works) / sizeof(works[0]); ++i) {
+    struct result r = {.name = "sleep", .mode = "-", .work_us = works[i]};
+    // Keep the slow cases from dominating the run time.
+    size_t n = g_options.iterations;
+    if (works[i] > 0 && n * works[i] > 2000000) {
+      n = 2000000 / works[i];
+    }
+    ok = run_case(&r, exe_path, &works[i], (int32_t)sizeof(works[i]), NULL, n < MIN_ITERATIONS ? MIN_ITERATIONS : n);
+    if (ok) {
+      print_result(&r);
+    }
+  }
+  return ok;
+}
+
+struct worker {
+  char const *exe_path;
+  void const *buf;
+  int32_t len;
+  uint64_t *samples;
+  size_t n;
+  bool ok;
+};
+
+static atomic_bool g_go = false;
+
+static int worker_main(void *const arg) {
+  struct worker *const w = arg;
+  // Start together so that the calls overlap from the first one.
+  while (!atomic_load_explicit(&g_go, memory_order_acquire)) {
+    thrd_yield();
+  }
+  for (size_t i = 0; i < w->n; ++i) {
+    void *reply = NULL;
+    int32_t reply_len = 0;
+    uint64_t const start = timer_now_ns();
+    int const err = bridge_call(w->exe_path, w->buf, w->len, NULL, 0, &reply, &reply_len);
+    uint64_t const end = timer_now_ns();
+    if (err != ECALL_OK) {
+      fprintf(stderr, "%s: bridge_call failed with %d\n", w->exe_path, err);
+      w->ok = false;
+      return 1;
+    }
+    bridge_free_reply(reply);
+    w->samples[i] = end - start;
+  }
+  return 0;
+}
+
+// Calls the child from threads threads at once, n calls in total, with up to pool_size instances of it.
+static bool run_parallel(struct result *const r,
+                         char const *const exe_path,
+                         void const *const buf,
+                         int32_t const len,
+                         size_t const pool_size,
+                         size_t const threads,
+                         size_t const n) {
+  if (bridge_set_pool_size(exe_path, pool_size) != ECALL_OK || bridge_preload(exe_path, buf, len) != ECALL_OK ||
+      bridge_ready(exe_path) != ECALL_OK) {
+    fprintf(stderr, "%s: failed to start %zu instances\n", exe_path, pool_size);
+    return false;
+  }
+  size_t const per_thread = (n + threads - 1) / threads;
+  uint64_t *const samples = malloc(per_thread * threads * sizeof(uint64_t));
+  if (!samples) {
+    return false;
+  }
+  struct worker workers[MAX_THREADS];
+  thrd_t handles[MAX_THREADS];
+  size_t started = 0;
+  atomic_store_explicit(&g_go, false, memory_order_relaxed);
+  for (; started < threads; ++started) {
+    workers[started] = (struct worker){
+        .exe_path = exe_path,
+        .buf = buf,
+        .len = len,
+        .samples = samples + started * per_thread,
+        .n = per_thread,
+        .ok = true,
+    };
+    if (thrd_create(&handles[started], worker_main, &workers[started]) != thrd_success) {
+      break;
+    }
+  }
+  uint64_t const start = timer_now_ns();
+  atomic_store_explicit(&g_go, true, memory_order_release);
+  bool ok = started == threads;
+  for (size_t i = 0; i < started; ++i) {
+    thrd_join(handles[i], NULL);
+    ok = ok && workers[i].ok;
+  }
+  uint64_t const wall = timer_now_ns() - start;
+  if (ok) {
+    r->threads = threads;
+    summarize(r, samples, per_thread * threads, wall);
+  }
+  free(samples);
+  return ok;
+}
+
+// Throughput of calls from several threads, with a single instance of the child and with one per thread.
+// Without a pool the calls queue up on the one instance, so calls_per_s should only scale with one.
+static bool bench_threads(void) {
+  static size_t const thread_counts[] = {1, 2, 4, MAX_THREADS};
+  static uint32_t const work = THREADS_WORK_US;
+  char child[1100];
+  child_path(child, sizeof(child), "sleep");
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+    size_t const threads = thread_counts[i];
+    // A pool of one is the same as no pool.
+    for (int pooled = 0; ok && pooled < (threads > 1 ? 2 : 1); ++pooled) {
+      size_t const pool_size = pooled ? threads : 1;
+      // Every configuration gets its own instances, the child ignores the extra argument.
+      char exe_path[1200];
+      snprintf(exe_path, sizeof(exe_path), "%s threads%zu_pool%zu", child, threads, pool_size);
+      char mode[32];
+      snprintf(mode, sizeof(mode), "pool=%zu", pool_size);
+      struct result r = {.name = "threads", .mode = mode, .work_us = work};
+      size_t n = g_options.iterations;
+      if (n * work > 2000000) {
+        n = 2000000 / work;
+      }
+      ok = run_parallel(&r, exe_path, &work, (int32_t)sizeof(work), pool_size, threads, n < threads ? threads : n);
+      if (ok) {
+        print_result(&r);
+      }
+    }
+  }
+  return ok;
+}
+
+// Round trips of a small request depending on who reads the reply and how the caller waits for it.
+// A synchronous child without the doorbell always sleeps in the pipe, so the policy only matters for the others.
+static bool bench_wait(void) {
+  static struct {
+    char const *name;
+    bool sync;
+    bool doorbell;
+    enum wait_policy policy;
+  } const configs[] = {
+      {"thread/adapt", false, false, WAIT_POLICY_ADAPTIVE},
+      {"thread/block", false, false, WAIT_POLICY_BLOCK},
+      {"thread/spin", false, false, WAIT_POLICY_SPIN},
+      {"sync", true, false, WAIT_POLICY_ADAPTIVE},
+      {"doorbell/adapt", true, true, WAIT_POLICY_ADAPTIVE},
+      {"doorbell/block", true, true, WAIT_POLICY_BLOCK},
+      {"doorbell/spin", true, true, WAIT_POLICY_SPIN},
+  };
+  static char const payload[64] = {0};
+  char child[1100];
+  child_path(child, sizeof(child), "echo");
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(configs) / sizeof(configs[0]); ++i) {
+    // Every configuration gets its own instance, the child ignores the extra argument.
+    char exe_path[1200];
+    snprintf(exe_path, sizeof(exe_path), "%s wait%zu", child, i);
+    if (bridge_set_sync(exe_path, configs[i].sync) != ECALL_OK ||
+        bridge_set_doorbell(exe_path, configs[i].doorbell) != ECALL_OK ||
+        bridge_set_wait_policy(exe_path, configs[i].policy, BRIDGE_DEFAULT_SPINS) != ECALL_OK) {
+      fprintf(stderr, "%s: failed to configure %s\n", exe_path, configs[i].name);
+      return false;
+    }
+    struct result r = {.name = "wait", .mode = configs[i].name, .bytes = sizeof(payload)};
+    ok = run_case(&r, exe_path, payload, (int32_t)sizeof(payload), NULL, g_options.iterations);
+    if (ok) {
+      print_result(&r);
+    }
+  }
+  return ok;
+}
+
+static bool parse_args(int const argc, char **const argv) {
+  for (int i = 1; i < argc; ++i) {
+    char const *const a = argv[i];
+    if (strcmp(a, "--format=text") == 0) {
+      g_options.format = FORMAT_TEXT;
+    } else if (strcmp(a, "--format=csv") == 0) {
+      g_options.format = FORMAT_CSV;
+    } else if (strcmp(a, "--format=json") == 0) {
+      g_options.format = FORMAT_JSON;
+    } else if (strncmp(a, "--iterations=", 13) == 0 && atoi(a + 13) > 0) {
+      g_options.iterations = (size_t)atoi(a + 13);
+    } else if (strncmp(a, "--filter=", 9) == 0) {
+      g_options.filter = a + 9;
+    } else {
+      fprintf(stderr, "usage: %s [--format=text|csv|json] [--iterations=N] [--filter=echo|frame|sleep|threads|wait]\n", argv[0]);
+      return false;
+    }
+  }
+  // The children are installed next to the driver.
+  char const *const slash = strrchr(argv[0], '/');
+#ifdef _WIN32
+  char const *const backslash = strrchr(argv[0], '\\');
+  char const *const sep = backslash > slash ? backslash : slash;
+#else
+  char const *const sep = slash;
+#endif
+  size_t const len = sep ? (size_t)(sep - argv[0]) + 1 : 0;
+  if (len >= sizeof(g_dir)) {
+    return false;
+  }
+  memcpy(g_dir, argv[0], len);
+  g_dir[len] = '\0';
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (!parse_args(argc, argv)) {
+    return 2;
+  }
+  if (!bridge_init(MAX_WIDTH, MAX_HEIGHT)) {
+    fprintf(stderr, "bridge_init failed\n");
+    return 1;
+  }
+  if (g_options.format == FORMAT_JSON) {
+    printf("{\n  \"results\": [");
+  }
+  bool ok = true;
+  if (ok && selected("echo")) {
+    ok = bench_echo();
+  }
+  if (ok && selected("frame")) {
+    ok = bench_frame();
+  }
+  if (ok && selected("sleep")) {
+    ok = bench_sleep();
+  }
+  if (ok && selected("threads")) {
+    ok = bench_threads();
+  }
+  if (ok && selected("wait")) {
+    ok = bench_wait();
+  }
+  if (g_options.format == FORMAT_JSON) {
+    printf("\n  ]\n}\n");
+  }
+  bridge_exit();
+  return ok ? 0 : 1;
+}
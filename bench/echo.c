@@ -0,0 +1,16 @@
+#include "bridge_child.h"
+
+// Replies with the request itself, which measures the transport alone.
+int main(void) {
+  if (!bridge_child_init()) {
+    return 1;
+  }
+  struct bridge_child_request req;
+  while (bridge_child_next(&req)) {
+    if (!bridge_child_reply(req.buf, req.len)) {
+      return 1;
+    }
+  }
+  bridge_child_exit();
+  return 0;
+}
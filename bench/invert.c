@@ -0,0 +1,26 @@
+#include "bridge_child.h"
+
+#include <stddef.h>
+
+// Inverts B, G and R of every pixel in place and replies with an empty string.
+int main(void) {
+  if (!bridge_child_init()) {
+    return 1;
+  }
+  struct bridge_child_request req;
+  while (bridge_child_next(&req)) {
+    if (!req.header) {
+      return 1;
+    }
+    uint32_t *const px = req.pixels;
+    size_t const n = (size_t)req.header->width * (size_t)req.header->height;
+    for (size_t i = 0; i < n; ++i) {
+      px[i] ^= UINT32_C(0x00ffffff);
+    }
+    if (!bridge_child_reply(NULL, 0)) {
+      return 1;
+    }
+  }
+  bridge_child_exit();
+  return 0;
+}
@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "threads.h"
+
+#include "hash.h"
+#include "hashmap.h"
+#include "mutex_queue.h"
+#include "pixfmt.h"
+#include "queue.h"
+#include "spin.h"
+#include "timer.h"
+
+// Measures the building blocks of a call one by one, without any child involved.
+//
+//   bridge_microbench [--format=csv|json] [--samples=N] [--filter=NAME]
+//
+// Each sample times a batch of operations, the numbers are per operation.
+
+// A batch should take long enough that reading the clock does not matter.
+#define BATCH_BYTES (256 * 1024)
+#define BATCH_MAX_OPS 4096
+// Large cases take fewer samples once they have touched this many bytes.
+#define BYTES_PER_CASE ((size_t)2 * 1024 * 1024 * 1024)
+#define MIN_SAMPLES 5
+
+enum format {
+  FORMAT_CSV,
+  FORMAT_JSON,
+};
+
+struct options {
+  enum format format;
+  size_t samples;
+  char const *filter;
+};
+
+static struct options g_options = {FORMAT_CSV, 200, NULL};
+static size_t g_results = 0;
+// Keeps the compiler from dropping the work whose result nobody reads.
+static volatile uint64_t g_sink = 0;
+
+static int compare_u64(void const *const a, void const *const b) {
+  uint64_t const x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t const *const sorted, size_t const n, double const p) {
+  size_t rank = (size_t)(p * (double)n + 0.999999);
+  if (rank < 1) {
+    rank = 1;
+  }
+  return (double)sorted[(rank > n ? n : rank) - 1];
+}
+
+// samples hold the nanoseconds of ops operations each, bytes is what one operation touches.
+static void report(char const *const name,
+                   char const *const param,
+                   uint64_t *const samples,
+                   size_t const n,
+                   size_t const ops,
+                   size_t const bytes) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += samples[i];
+  }
+  qsort(samples, n, sizeof(uint64_t), compare_u64);
+  double const per_op = (double)ops;
+  double const mean = (double)total / (double)n / per_op;
+  double const mb_per_s = total && bytes ? (double)bytes * per_op * (double)n / ((double)total / 1e9) / 1048576.0 : 0;
+  if (g_options.format == FORMAT_CSV) {
+    if (g_results == 0) {
+      printf("benchmark,param,samples,ops_per_sample,mean_ns,p50_ns,p90_ns,p99_ns,max_ns,mb_per_s\n");
+    }
+    printf("%s,%s,%zu,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+           name,
+           param,
+           n,
+           ops,
+           mean,
+           percentile(samples, n, 0.5) / per_op,
+           percentile(samples, n, 0.9) / per_op,
+           percentile(samples, n, 0.99) / per_op,
+           (double)samples[n - 1] / per_op,
+           mb_per_s);
+  } else {
+    printf("%s\n    {\"benchmark\": \"%s\", \"param\": \"%s\", \"samples\": %zu, \"ops_per_sample\": %zu, "
+           "\"mean_ns\": %.2f, \"p50_ns\": %.2f, \"p90_ns\": %.2f, \"p99_ns\": %.2f, \"max_ns\": %.2f, "
+           "\"mb_per_s\": %.2f}",
+           g_results == 0 ? "" : ",",
+           name,
+           param,
+           n,
+           ops,
+           mean,
+           percentile(samples, n, 0.5) / per_op,
+           percentile(samples, n, 0.9) / per_op,
+           percentile(samples, n, 0.99) / per_op,
+           (double)samples[n - 1] / per_op,
+           mb_per_s);
+  }
+  fflush(stdout);
+  ++g_results;
+}
+
+static size_t ops_for(size_t const bytes) {
+  size_t const ops = bytes ? BATCH_BYTES / bytes : BATCH_MAX_OPS;
+  return ops < 1 ? 1 : ops > BATCH_MAX_OPS ? BATCH_MAX_OPS : ops;
+}
+
+static size_t samples_for(size_t const bytes) {
+  size_t n = g_options.samples;
+  if (bytes > 0 && n * bytes > BYTES_PER_CASE) {
+    n = BYTES_PER_CASE / bytes;
+  }
+  return n < MIN_SAMPLES ? MIN_SAMPLES : n;
+}
+
+static bool selected(char const *const name) { return !g_options.filter || strcmp(g_options.filter, name) == 0; }
+
+// Queue handoff: the producer stamps an item and pushes it, the consumer takes the difference when it pops it,
+// then sends it back so that only one item is in flight.
+
+// The queue under test, so that src/queue.c and the mutex queue it replaced run the same handoff.
+struct queue_ops {
+  char const *name;
+  void *(*init)(void);
+  void (*destroy)(void *const q);
+  bool (*push)(void *const q, void *item);
+  void *(*pop)(void *const q);
+  void *(*pop_nowait)(void *const q);
+};
+
+static void *spsc_init(void) { return queue_init(); }
+static void spsc_destroy(void *const q) { queue_release(q); }
+static bool spsc_push(void *const q, void *item) { return queue_push(q, item); }
+static void *spsc_pop(void *const q) { return queue_pop(q); }
+static void *spsc_pop_nowait(void *const q) { return queue_pop_nowait(q); }
+
+// process.c created its queues with 4 slots.
+static void *mutex_init(void) { return mutex_queue_init(4); }
+static void mutex_destroy(void *const q) { mutex_queue_destroy(q); }
+static bool mutex_push(void *const q, void *item) { return mutex_queue_push(q, item); }
+static void *mutex_pop(void *const q) { return mutex_queue_pop(q); }
+static void *mutex_pop_nowait(void *const q) { return mutex_queue_pop_nowait(q); }
+
+static struct queue_ops const g_queues[] = {
+    {"spsc", spsc_init, spsc_destroy, spsc_push, spsc_pop, spsc_pop_nowait},
+    {"mutex", mutex_init, mutex_destroy, mutex_push, mutex_pop, mutex_pop_nowait},
+};
+
+struct handoff {
+  struct queue_ops const *ops;
+  void *forward;
+  void *backward;
+  bool poll;
+  size_t n;
+  uint64_t *samples;
+};
+
+static void *pop_wait(struct queue_ops const *const ops, void *const q, bool const poll) {
+  if (!poll) {
+    return ops->pop(q);
+  }
+  void *r;
+  while (!(r = ops->pop_nowait(q))) {
+    if (spin_useful()) {
+      cpu_relax();
+    } else {
+      thrd_yield();
+    }
+  }
+  return r;
+}
+
+static int handoff_consumer(void *const userdata) {
+  struct handoff *const h = userdata;
+  for (size_t i = 0; i < h->n; ++i) {
+    uint64_t *const stamp = pop_wait(h->ops, h->forward, h->poll);
+    h->samples[i] = timer_now_ns() - *stamp;
+    h->ops->push(h->backward, stamp);
+  }
+  return 0;
+}
+
+static bool bench_queue(void) {
+  static char const *const modes[] = {"block", "poll"};
+  for (size_t q = 0; q < sizeof(g_queues) / sizeof(g_queues[0]); ++q) {
+    struct queue_ops const *const ops = &g_queues[q];
+    for (size_t mode = 0; mode < 2; ++mode) {
+      struct handoff h = {
+          .ops = ops,
+          .forward = ops->init(),
+          .backward = ops->init(),
+          .poll = mode == 1,
+          .n = g_options.samples * 10,
+      };
+      h.samples = malloc(h.n * sizeof(uint64_t));
+      uint64_t stamp = 0;
+      thrd_t th;
+      if (!h.forward || !h.backward || !h.samples || thrd_create(&th, handoff_consumer, &h) != thrd_success) {
+        free(h.samples);
+        if (h.backward) {
+          ops->destroy(h.backward);
+        }
+        if (h.forward) {
+          ops->destroy(h.forward);
+        }
+        return false;
+      }
+      for (size_t i = 0; i < h.n; ++i) {
+        stamp = timer_now_ns();
+        ops->push(h.forward, &stamp);
+        pop_wait(ops, h.backward, h.poll);
+      }
+      thrd_join(th, NULL);
+      char param[32];
+      snprintf(param, sizeof(param), "%s/%s", ops->name, modes[mode]);
+      report("queue_handoff", param, h.samples, h.n, 1, 0);
+      free(h.samples);
+      ops->destroy(h.backward);
+      ops->destroy(h.forward);
+    }
+  }
+  return true;
+}
+
+static bool bench_hashmap(void) {
+  static size_t const counts[] = {1, 8, 64};
+  enum { max_keys = 64, key_size = 128 };
+  char(*const keys)[key_size] = malloc(max_keys * key_size);
+  unsigned lens[max_keys];
+  uint64_t *const samples = malloc(g_options.samples * sizeof(uint64_t));
+  if (!keys || !samples) {
+    free(keys);
+    free(samples);
+    return false;
+  }
+  for (size_t i = 0; i < max_keys; ++i) {
+    lens[i] = (unsigned)snprintf(
+        keys[i], key_size, "C:\\Users\\bench\\AviUtl\\script\\tool%02zu\\bin\\filter_%zu.exe --mode=fast", i, i * 7);
+  }
+  for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+    struct hashmap_s map;
+    if (hashmap_create(2, &map) != 0) {
+      free(samples);
+      free(keys);
+      return false;
+    }
+    for (size_t i = 0; i < counts[c]; ++i) {
+      hashmap_put(&map, keys[i], lens[i], keys[i]);
+    }
+    size_t const ops = BATCH_MAX_OPS;
+    for (size_t s = 0; s <= g_options.samples; ++s) {
+      uint64_t found = 0;
+      uint64_t const start = timer_now_ns();
+      for (size_t i = 0; i < ops; ++i) {
+        size_t const k = i % counts[c];
+        found += hashmap_get(&map, keys[k], lens[k]) != NULL;
+      }
+      uint64_t const end = timer_now_ns();
+      if (s > 0) {
+        samples[s - 1] = end - start;
+      }
+      g_sink += found;
+    }
+    char param[32];
+    snprintf(param, sizeof(param), "%zu keys", counts[c]);
+    report("hashmap_get", param, samples, g_options.samples, ops, 0);
+    hashmap_destroy(&map);
+  }
+  free(samples);
+  free(keys);
+  return true;
+}
+
+enum hash_kind {
+  HASH_CYRB64,
+  HASH_WIDE_SCALAR,
+  HASH_WIDE_SSE2,
+  HASH_WIDE_AVX2,
+};
+
+static uint64_t run_hash(enum hash_kind const kind, uint32_t const *const src, size_t const words) {
+  switch (kind) {
+  case HASH_CYRB64:
+    return cyrb64(src, words, PIXEL_HASH_SEED);
+  case HASH_WIDE_SCALAR:
+    return cyrb64_wide_impl(src, words, PIXEL_HASH_SEED, HASH_IMPL_SCALAR);
+  case HASH_WIDE_SSE2:
+    return cyrb64_wide_impl(src, words, PIXEL_HASH_SEED, HASH_IMPL_SSE2);
+  case HASH_WIDE_AVX2:
+    return cyrb64_wide_impl(src, words, PIXEL_HASH_SEED, HASH_IMPL_AVX2);
+  }
+  return 0;
+}
+
+static bool bench_hash(void) {
+  static struct {
+    char const *name;
+    enum hash_kind kind;
+  } const kinds[] = {
+      {"cyrb64", HASH_CYRB64},
+      {"cyrb64_wide_scalar", HASH_WIDE_SCALAR},
+      {"cyrb64_wide_sse2", HASH_WIDE_SSE2},
+      {"cyrb64_wide_avx2", HASH_WIDE_AVX2},
+  };
+  static size_t const sizes[] = {64, 4096, 1024 * 1024, 1920 * 1080 * 4, 3840 * 2160 * 4, 7680 * 4320 * 4};
+  size_t const max_size = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+  uint32_t *const src = malloc(max_size);
+  uint64_t *const samples = malloc(g_options.samples * sizeof(uint64_t));
+  if (!src || !samples) {
+    free(src);
+    free(samples);
+    return false;
+  }
+  for (size_t i = 0; i < max_size / 4; ++i) {
+    src[i] = (uint32_t)i * 2654435761u;
+  }
+  for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+    if ((kinds[k].kind == HASH_WIDE_SSE2 && hash_best_impl() < HASH_IMPL_SSE2) ||
+        (kinds[k].kind == HASH_WIDE_AVX2 && hash_best_impl() < HASH_IMPL_AVX2)) {
+      continue;
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      size_t const ops = ops_for(sizes[i]), n = samples_for(sizes[i] * ops);
+      // The first batch warms the caches up and is not counted.
+      for (size_t s = 0; s <= n; ++s) {
+        uint64_t h = 0;
+        uint64_t const start = timer_now_ns();
+        for (size_t j = 0; j < ops; ++j) {
+          h ^= run_hash(kinds[k].kind, src, sizes[i] / 4);
+        }
+        uint64_t const end = timer_now_ns();
+        if (s > 0) {
+          samples[s - 1] = end - start;
+        }
+        g_sink += h;
+      }
+      char param[32];
+      snprintf(param, sizeof(param), "%zu bytes", sizes[i]);
+      report(kinds[k].name, param, samples, n, ops, sizes[i]);
+    }
+  }
+  free(samples);
+  free(src);
+  return true;
+}
+
+// The copies bridge_call makes for PIXEL_FORMAT_BGRA, next to a plain memcpy of the same size.
+static bool bench_copy(void) {
+  static struct {
+    size_t width;
+    size_t height;
+  } const frames[] = {
+      {320, 240},
+      {640, 480},
+      {1280, 720},
+      {1920, 1080},
+      {3840, 2160},
+      {7680, 4320},
+  };
+  size_t const max_size = 7680 * 4320 * 4;
+  uint8_t *const src = malloc(max_size);
+  uint8_t *const dest = malloc(max_size);
+  uint64_t *const samples = malloc(g_options.samples * sizeof(uint64_t));
+  if (!src || !dest || !samples) {
+    free(src);
+    free(dest);
+    free(samples);
+    return false;
+  }
+  memset(src, 0x5a, max_size);
+  for (size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); ++f) {
+    size_t const w = frames[f].width, h = frames[f].height, bytes = w * h * 4;
+    char param[32];
+    snprintf(param, sizeof(param), "%zux%zu", w, h);
+    for (int kind = 0; kind < 3; ++kind) {
+      size_t const ops = ops_for(bytes), n = samples_for(bytes * ops);
+      for (size_t s = 0; s <= n; ++s) {
+        uint64_t const start = timer_now_ns();
+        for (size_t j = 0; j < ops; ++j) {
+          if (kind == 0) {
+            memcpy(dest, src, bytes);
+          } else if (kind == 1) {
+            pixfmt_encode(PIXEL_FORMAT_BGRA, dest, src, w, h, 0, 0, w, h);
+          } else {
+            pixfmt_decode(PIXEL_FORMAT_BGRA, dest, src, w, h, 0, 0, w, h);
+          }
+        }
+        uint64_t const end = timer_now_ns();
+        if (s > 0) {
+          samples[s - 1] = end - start;
+        }
+        g_sink += dest[s % bytes];
+      }
+      static char const *const names[] = {"memcpy", "upload", "write_back"};
+      report(names[kind], param, samples, n, ops, bytes);
+    }
+  }
+  free(samples);
+  free(dest);
+  free(src);
+  return true;
+}
+
+static bool parse_args(int const argc, char **const argv) {
+  for (int i = 1; i < argc; ++i) {
+    char const *const a = argv[i];
+    if (strcmp(a, "--format=csv") == 0) {
+      g_options.format = FORMAT_CSV;
+    } else if (strcmp(a, "--format=json") == 0) {
+      g_options.format = FORMAT_JSON;
+    } else if (strncmp(a, "--samples=", 10) == 0 && atoi(a + 10) > 0) {
+      // samples_for never goes below MIN_SAMPLES and the sample buffers are sized by this option.
+      size_t const n = (size_t)atoi(a + 10);
+      g_options.samples = n < MIN_SAMPLES ? MIN_SAMPLES : n;
+    } else if (strncmp(a, "--filter=", 9) == 0) {
+      g_options.filter = a + 9;
+    } else {
+      fprintf(
+          stderr, "usage: %s [--format=csv|json] [--samples=N] [--filter=queue|hashmap|hash|copy]\n", argv[0]);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (!parse_args(argc, argv)) {
+    return 2;
+  }
+  if (g_options.format == FORMAT_JSON) {
+    printf("{\n  \"results\": [");
+  }
+  bool ok = true;
+  if (ok && selected("queue")) {
+    ok = bench_queue();
+  }
+  if (ok && selected("hashmap")) {
+    ok = bench_hashmap();
+  }
+  if (ok && selected("hash")) {
+    ok = bench_hash();
+  }
+  if (ok && selected("copy")) {
+    ok = bench_copy();
+  }
+  if (g_options.format == FORMAT_JSON) {
+    printf("\n  ]\n}\n");
+  }
+  if (!ok) {
+    fprintf(stderr, "out of memory\n");
+  }
+  return ok ? 0 : 1;
+}
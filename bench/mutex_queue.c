@@ -0,0 +1,115 @@
+#include "mutex_queue.h"
+
+#include "threads.h"
+
+#include <stdlib.h>
+
+struct mutex_queue {
+  mtx_t mtx;
+  cnd_t cnd;
+  void **items;
+  int num_items, used;
+  int readcur, writecur;
+};
+
+struct mutex_queue *mutex_queue_init(int const num_items) {
+  int mtx_ret = thrd_error;
+  int cnd_ret = thrd_error;
+  struct mutex_queue *const q = malloc(sizeof(struct mutex_queue));
+  if (!q) {
+    return NULL;
+  }
+  q->items = calloc((size_t)num_items, sizeof(void *));
+  if (!q->items) {
+    goto cleanup;
+  }
+  q->num_items = num_items;
+  q->used = 0;
+  q->readcur = 0;
+  q->writecur = 0;
+  mtx_ret = mtx_init(&q->mtx, mtx_plain | mtx_recursive);
+  if (mtx_ret != thrd_success) {
+    goto cleanup;
+  }
+  cnd_ret = cnd_init(&q->cnd);
+  if (cnd_ret != thrd_success) {
+    goto cleanup;
+  }
+  return q;
+cleanup:
+  if (cnd_ret == thrd_success) {
+    cnd_destroy(&q->cnd);
+  }
+  if (mtx_ret == thrd_success) {
+    mtx_destroy(&q->mtx);
+  }
+  free(q->items);
+  free(q);
+  return NULL;
+}
+
+void mutex_queue_destroy(struct mutex_queue *const q) {
+  cnd_destroy(&q->cnd);
+  mtx_destroy(&q->mtx);
+  free(q->items);
+  free(q);
+}
+
+bool mutex_queue_push(struct mutex_queue *const q, void *item) {
+  mtx_lock(&q->mtx);
+  if (q->used == q->num_items) {
+    void **items = malloc((size_t)(q->num_items * 2) * sizeof(void *));
+    if (!items) {
+      mtx_unlock(&q->mtx);
+      return false;
+    }
+    for (int i = 0; i < q->used; ++i) {
+      items[i] = q->items[(q->readcur + i) % q->num_items];
+    }
+    free(q->items);
+    q->items = items;
+    q->readcur = 0;
+    q->writecur = q->used;
+    q->num_items *= 2;
+  }
+  q->items[q->writecur] = item;
+  ++q->used;
+  q->writecur = (q->writecur + 1) % q->num_items;
+  cnd_signal(&q->cnd);
+  mtx_unlock(&q->mtx);
+  return true;
+}
+
+void *mutex_queue_pop(struct mutex_queue *const q) {
+  void *r = NULL;
+  mtx_lock(&q->mtx);
+  while (q->used == 0) {
+    cnd_wait(&q->cnd, &q->mtx);
+  }
+  r = q->items[q->readcur];
+  q->items[q->readcur] = NULL;
+  --q->used;
+  q->readcur = (q->readcur + 1) % q->num_items;
+  mtx_unlock(&q->mtx);
+  return r;
+}
+
+void *mutex_queue_pop_nowait(struct mutex_queue *const q) {
+  void *r = NULL;
+  mtx_lock(&q->mtx);
+  if (q->used > 0) {
+    r = q->items[q->readcur];
+    q->items[q->readcur] = NULL;
+    --q->used;
+    q->readcur = (q->readcur + 1) % q->num_items;
+  }
+  mtx_unlock(&q->mtx);
+  return r;
+}
+
+bool mutex_queue_empty(struct mutex_queue *const q) {
+  mtx_lock(&q->mtx);
+  bool const r = q->used == 0;
+  mtx_unlock(&q->mtx);
+  return r;
+}
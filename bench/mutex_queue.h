@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+// The queue process.c used before src/queue.c, a ring guarded by a mutex and a condition variable.
+// It is only kept so that the micro benchmark can compare the two.
+struct mutex_queue;
+
+struct mutex_queue *mutex_queue_init(int const num_items);
+void mutex_queue_destroy(struct mutex_queue *const q);
+bool mutex_queue_push(struct mutex_queue *const q, void *item);
+void *mutex_queue_pop(struct mutex_queue *const q);
+void *mutex_queue_pop_nowait(struct mutex_queue *const q);
+bool mutex_queue_empty(struct mutex_queue *const q);
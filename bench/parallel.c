@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bridge.h"
+#include "threads.h"
+#include "timer.h"
+
+// Checks that calls to different executables run at the same time instead of waiting for each other.
+// Each child sleeps, so their calls overlap even on a single CPU unless the bridge serializes them.
+//
+//   bridge_parallel_test
+
+#define MAX_WIDTH 64
+#define MAX_HEIGHT 64
+#define NUM_CHILDREN 4
+#define WORK_US 200000
+
+static char g_dir[1024];
+
+static bool set_dir(char const *const argv0) {
+  char const *const slash = strrchr(argv0, '/');
+#ifdef _WIN32
+  char const *const backslash = strrchr(argv0, '\\');
+  char const *const sep = backslash > slash ? backslash : slash;
+#else
+  char const *const sep = slash;
+#endif
+  size_t const len = sep ? (size_t)(sep - argv0) + 1 : 0;
+  if (len >= sizeof(g_dir)) {
+    return false;
+  }
+  memcpy(g_dir, argv0, len);
+  g_dir[len] = '\0';
+  return true;
+}
+
+struct worker {
+  char exe_path[1200];
+  bool ok;
+};
+
+static int worker_main(void *const arg) {
+  struct worker *const w = arg;
+  static uint32_t const work = WORK_US;
+  void *r = NULL;
+  int32_t rlen = 0;
+  int const err = bridge_call(w->exe_path, &work, (int32_t)sizeof(work), NULL, 0, &r, &rlen);
+  if (err != ECALL_OK) {
+    fprintf(stderr, "%s: bridge_call failed with %d\n", w->exe_path, err);
+    return 1;
+  }
+  bridge_free_reply(r);
+  w->ok = true;
+  return 0;
+}
+
+static bool run(struct worker *const workers) {
+  // The children are started beforehand, so the time below only covers the calls.
+  for (size_t i = 0; i < NUM_CHILDREN; ++i) {
+    if (bridge_preload(workers[i].exe_path, NULL, 0) != ECALL_OK || bridge_ready(workers[i].exe_path) != ECALL_OK) {
+      fprintf(stderr, "%s: failed to start\n", workers[i].exe_path);
+      return false;
+    }
+  }
+  thrd_t handles[NUM_CHILDREN];
+  size_t started = 0;
+  uint64_t const start = timer_now_ns();
+  for (; started < NUM_CHILDREN; ++started) {
+    if (thrd_create(&handles[started], worker_main, &workers[started]) != thrd_success) {
+      break;
+    }
+  }
+  bool ok = started == NUM_CHILDREN;
+  for (size_t i = 0; i < started; ++i) {
+    thrd_join(handles[i], NULL);
+    ok = ok && workers[i].ok;
+  }
+  uint64_t const wall = timer_now_ns() - start;
+  if (!ok) {
+    return false;
+  }
+  // Serialized calls take at least NUM_CHILDREN * WORK_US, overlapped ones a little more than WORK_US.
+  uint64_t const serial = (uint64_t)NUM_CHILDREN * WORK_US * 1000;
+  if (wall >= serial / 2) {
+    fprintf(stderr,
+            "%d calls took %llu ms, the calls did not overlap (%llu ms if serialized)\n",
+            NUM_CHILDREN,
+            (unsigned long long)(wall / 1000000),
+            (unsigned long long)(serial / 1000000));
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  if (!set_dir(argv[0])) {
+    return 2;
+  }
+  struct worker workers[NUM_CHILDREN];
+  for (size_t i = 0; i < NUM_CHILDREN; ++i) {
+    // The argument makes every command line a different executable for the bridge.
+#ifdef _WIN32
+    snprintf(workers[i].exe_path, sizeof(workers[i].exe_path), "\"%sbench_sleep.exe\" sleep %zu", g_dir, i);
+#else
+    snprintf(workers[i].exe_path, sizeof(workers[i].exe_path), "%sbench_sleep sleep %zu", g_dir, i);
+#endif
+    workers[i].ok = false;
+  }
+  if (!bridge_init(MAX_WIDTH, MAX_HEIGHT)) {
+    fprintf(stderr, "bridge_init failed\n");
+    return 1;
+  }
+  bool const ok = run(workers);
+  bridge_exit();
+  return ok ? 0 : 1;
+}
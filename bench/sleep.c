@@ -0,0 +1,40 @@
+#include "bridge_child.h"
+
+#include <string.h>
+
+#include "threads.h"
+#include "timer.h"
+
+// Busy-waits, sleeping would add the timer slack of the system to every request.
+static void spin_us(uint32_t const us) {
+  uint64_t const deadline = timer_now_ns() + (uint64_t)us * 1000;
+  while (timer_now_ns() < deadline) {
+  }
+}
+
+// Takes a uint32_t number of microseconds, waits that long and replies with an empty string.
+// It stands in for a child that does a fixed amount of work, so the rest of the round trip is overhead.
+// Started as "bench_sleep sleep" it sleeps instead, so that several of them overlap even on a single CPU.
+int main(int argc, char **argv) {
+  bool const sleeping = argc > 1 && strcmp(argv[1], "sleep") == 0;
+  if (!bridge_child_init()) {
+    return 1;
+  }
+  struct bridge_child_request req;
+  while (bridge_child_next(&req)) {
+    uint32_t us = 0;
+    if (req.len >= (int32_t)sizeof(us)) {
+      memcpy(&us, req.buf, sizeof(us));
+    }
+    if (sleeping) {
+      thrd_sleep(&(struct timespec){.tv_sec = us / 1000000, .tv_nsec = (long)(us % 1000000) * 1000}, NULL);
+    } else {
+      spin_us(us);
+    }
+    if (!bridge_child_reply(NULL, 0)) {
+      return 1;
+    }
+  }
+  bridge_child_exit();
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge.h"
+#include "threads.h"
+#include "timer.h"
+
+// Checks that bridge_poll reports the reply of a synchronous child that is larger than the pipe buffer,
+// which the child cannot finish writing until the bridge starts reading it.
+//
+//   bridge_sync_poll_test
+
+#define MAX_WIDTH 64
+#define MAX_HEIGHT 64
+#define REPLY_SIZE (4 * 1024 * 1024)
+#define TIMEOUT_NS ((uint64_t)10 * 1000 * 1000 * 1000)
+
+static char g_dir[1024];
+
+static bool set_dir(char const *const argv0) {
+  char const *const slash = strrchr(argv0, '/');
+#ifdef _WIN32
+  char const *const backslash = strrchr(argv0, '\\');
+  char const *const sep = backslash > slash ? backslash : slash;
+#else
+  char const *const sep = slash;
+#endif
+  size_t const len = sep ? (size_t)(sep - argv0) + 1 : 0;
+  if (len >= sizeof(g_dir)) {
+    return false;
+  }
+  memcpy(g_dir, argv0, len);
+  g_dir[len] = '\0';
+  return true;
+}
+
+static bool run(char const *const exe_path, char const *const payload) {
+  struct bridge_ticket *ticket = NULL;
+  int err = bridge_call_async(exe_path, payload, REPLY_SIZE, NULL, 0, &ticket);
+  if (err != ECALL_OK) {
+    fprintf(stderr, "bridge_call_async failed: %d\n", err);
+    return false;
+  }
+  uint64_t const deadline = timer_now_ns() + TIMEOUT_NS;
+  while (!bridge_poll(ticket)) {
+    if (timer_now_ns() > deadline) {
+      fprintf(stderr, "bridge_poll did not report the reply\n");
+      bridge_cancel(ticket);
+      return false;
+    }
+    thrd_sleep(&(struct timespec){.tv_nsec = 1000 * 1000}, NULL);
+  }
+  void *r = NULL;
+  int32_t rlen = 0;
+  err = bridge_wait(ticket, &r, &rlen, NULL);
+  if (err != ECALL_OK) {
+    fprintf(stderr, "bridge_wait failed: %d\n", err);
+    return false;
+  }
+  bool const ok = rlen == REPLY_SIZE && memcmp(r, payload, REPLY_SIZE) == 0;
+  if (!ok) {
+    fprintf(stderr, "the reply differs from the request\n");
+  }
+  bridge_free_reply(r);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  if (!set_dir(argv[0])) {
+    return 2;
+  }
+  char exe_path[1100];
+#ifdef _WIN32
+  snprintf(exe_path, sizeof(exe_path), "\"%sbench_echo.exe\"", g_dir);
+#else
+  snprintf(exe_path, sizeof(exe_path), "%sbench_echo", g_dir);
+#endif
+  char *const payload = malloc(REPLY_SIZE);
+  if (!payload) {
+    return 1;
+  }
+  for (size_t i = 0; i < REPLY_SIZE; ++i) {
+    payload[i] = (char)(i * 31 + 7);
+  }
+  if (!bridge_init(MAX_WIDTH, MAX_HEIGHT)) {
+    fprintf(stderr, "bridge_init failed\n");
+    free(payload);
+    return 1;
+  }
+  bool ok = bridge_set_sync(exe_path, true) == ECALL_OK;
+  // The second call reuses the reply buffer and the child that is already running.
+  for (int i = 0; ok && i < 2; ++i) {
+    ok = run(exe_path, payload);
+  }
+  bridge_exit();
+  free(payload);
+  return ok ? 0 : 1;
+}
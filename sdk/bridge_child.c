@@ -0,0 +1,406 @@
+#include "bridge_child.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "doorbell.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+// The smallest read buffer, so the length and the payload of a small request usually come in with one read.
+#define READ_CHUNK 65536
+// Smaller replies are copied after their length and written at once, larger ones go through the reply area if it
+// has room.
+#define SMALL_REPLY 4096
+// How often a child waiting on the doorbell checks whether the bridge has closed stdin.
+#define STDIN_CHECK_MS 100
+
+static struct {
+  wchar_t name[64];
+  struct share_mem_header *view;
+  size_t view_size;
+  struct doorbell *bell;
+  // Requests are read into in, the unconsumed ones are between in_begin and in_end.
+  char *in;
+  size_t in_cap;
+  size_t in_begin;
+  size_t in_end;
+  // Byte counter of the reply area like channel.request_write.
+  uint32_t reply_write;
+  char out[SMALL_REPLY];
+#ifdef _WIN32
+  HANDLE stdin_handle;
+  HANDLE stdout_handle;
+#endif
+} g;
+
+#ifdef _WIN32
+
+static size_t read_some(void *const buf, size_t const size) {
+  DWORD n = 0;
+  DWORD const want = size > MAXDWORD ? MAXDWORD : (DWORD)size;
+  if (!ReadFile(g.stdin_handle, buf, want, &n, NULL)) {
+    return 0;
+  }
+  return (size_t)n;
+}
+
+static bool write_all(void const *const buf, size_t const size) {
+  char const *p = buf;
+  size_t left = size;
+  while (left) {
+    DWORD n = 0;
+    DWORD const want = left > MAXDWORD ? MAXDWORD : (DWORD)left;
+    if (!WriteFile(g.stdout_handle, p, want, &n, NULL)) {
+      return false;
+    }
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+static bool stdin_closed(void) {
+  DWORD avail = 0;
+  return !PeekNamedPipe(g.stdin_handle, NULL, 0, NULL, &avail, NULL);
+}
+
+static void unmap(void) {
+  if (g.view) {
+    UnmapViewOfFile(g.view);
+    g.view = NULL;
+    g.view_size = 0;
+  }
+}
+
+static bool map(void) {
+  HANDLE const fmo = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, g.name);
+  if (!fmo) {
+    return false;
+  }
+  void *const view = MapViewOfFile(fmo, FILE_MAP_WRITE, 0, 0, 0);
+  // The view keeps the mapping alive.
+  CloseHandle(fmo);
+  if (!view) {
+    return false;
+  }
+  MEMORY_BASIC_INFORMATION mbi;
+  if (!VirtualQuery(view, &mbi, sizeof(mbi))) {
+    UnmapViewOfFile(view);
+    return false;
+  }
+  g.view = view;
+  g.view_size = mbi.RegionSize;
+  return true;
+}
+
+static bool get_name(void) {
+  DWORD const n = GetEnvironmentVariableW(L"BRIDGE_FMO", g.name, sizeof(g.name) / sizeof(g.name[0]));
+  return n > 0 && n < sizeof(g.name) / sizeof(g.name[0]);
+}
+
+#else
+
+static size_t read_some(void *const buf, size_t const size) {
+  for (;;) {
+    ssize_t const n = read(STDIN_FILENO, buf, size);
+    if (n >= 0) {
+      return (size_t)n;
+    }
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+}
+
+static bool write_all(void const *const buf, size_t const size) {
+  char const *p = buf;
+  size_t left = size;
+  while (left) {
+    ssize_t const n = write(STDOUT_FILENO, p, left);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    left -= (size_t)n;
+  }
+  return true;
+}
+
+static bool stdin_closed(void) {
+  // Nothing is sent through stdin while the doorbell is used, so anything readable means it was closed.
+  struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+  if (poll(&pfd, 1, 0) <= 0) {
+    return false;
+  }
+  char c;
+  ssize_t const n = read(STDIN_FILENO, &c, 1);
+  return n == 0 || (n < 0 && errno != EINTR);
+}
+
+static void unmap(void) {
+  if (g.view) {
+    munmap(g.view, g.view_size);
+    g.view = NULL;
+    g.view_size = 0;
+  }
+}
+
+static bool map(void) {
+  char path[sizeof(g.name) / sizeof(g.name[0]) + 1];
+  path[0] = '/';
+  if (wcstombs(path + 1, g.name, sizeof(path) - 1) == (size_t)-1) {
+    return false;
+  }
+  int const fd = shm_open(path, O_RDWR, 0);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  void *view = MAP_FAILED;
+  if (fstat(fd, &st) == 0) {
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  // The mapping keeps the object alive.
+  close(fd);
+  if (view == MAP_FAILED) {
+    return false;
+  }
+  g.view = view;
+  g.view_size = (size_t)st.st_size;
+  return true;
+}
+
+static bool get_name(void) {
+  char const *const name = getenv("BRIDGE_FMO");
+  if (!name) {
+    return false;
+  }
+  size_t const n = mbstowcs(g.name, name, sizeof(g.name) / sizeof(g.name[0]));
+  return n != (size_t)-1 && n < sizeof(g.name) / sizeof(g.name[0]);
+}
+
+#endif
+
+static bool doorbell_enabled(struct share_mem_header const *const h) { return h->version >= 7 && h->doorbell; }
+
+static bool open_view(void) {
+  if (!map()) {
+    return false;
+  }
+  if (doorbell_enabled(g.view)) {
+    g.bell = doorbell_open(g.name, g.view);
+    if (!g.bell) {
+      unmap();
+      return false;
+    }
+  }
+  return true;
+}
+
+static void close_view(void) {
+  if (g.bell) {
+    doorbell_destroy(g.bell);
+    g.bell = NULL;
+  }
+  unmap();
+}
+
+// Everything the header points at has to be inside the view.
+static size_t required_size(struct share_mem_header const *const h) {
+  size_t r = (size_t)h->header_size + (size_t)h->body_size;
+  if (h->version >= 6) {
+    size_t const request_end = (size_t)h->request_area_offset + (size_t)h->request_area_size;
+    size_t const reply_end = (size_t)h->reply_area_offset + (size_t)h->reply_area_size;
+    r = request_end > r ? request_end : r;
+    r = reply_end > r ? reply_end : r;
+  }
+  return r;
+}
+
+// The bridge gives every child its own shared memory and never resizes it,
+// but a header that grew beyond the view is mapped again instead of being read out of bounds.
+static bool check_view(void) {
+  if (!g.view || required_size(g.view) <= g.view_size) {
+    return true;
+  }
+  close_view();
+  return open_view() && required_size(g.view) <= g.view_size;
+}
+
+// Makes sure that at least n unconsumed bytes are in the buffer.
+static bool fill(size_t const n) {
+  while (g.in_end - g.in_begin < n) {
+    if (g.in_cap - g.in_begin < n) {
+      if (g.in_end > g.in_begin) {
+        memmove(g.in, g.in + g.in_begin, g.in_end - g.in_begin);
+      }
+      g.in_end -= g.in_begin;
+      g.in_begin = 0;
+      if (g.in_cap < n) {
+        size_t const cap = n > READ_CHUNK ? n : READ_CHUNK;
+        char *const in = realloc(g.in, cap);
+        if (!in) {
+          return false;
+        }
+        g.in = in;
+        g.in_cap = cap;
+      }
+    }
+    size_t const r = read_some(g.in + g.in_end, g.in_cap - g.in_end);
+    if (r == 0) {
+      return false;
+    }
+    g.in_end += r;
+  }
+  return true;
+}
+
+static void const *request_area(uint32_t const offset, uint32_t const size) {
+  struct share_mem_header *const h = g.view;
+  if (!h || h->version < 6 || offset > h->request_area_size || size > h->request_area_size - offset) {
+    return NULL;
+  }
+  return (char const *)h + h->request_area_offset + offset;
+}
+
+// Places buf in the reply area in the same way as channel_put, returns false if it does not fit.
+static bool put_reply(void const *const buf, uint32_t const n, uint32_t *const offset) {
+  struct share_mem_header *const h = g.view;
+  if (!h || h->version < 6 || !h->reply_area_size || n > h->reply_area_size) {
+    return false;
+  }
+  uint32_t const size = h->reply_area_size;
+  uint32_t const pos = g.reply_write & (size - 1);
+  uint32_t const skip = size - pos < n ? size - pos : 0;
+  uint32_t const read = __atomic_load_n(&h->reply_read, __ATOMIC_ACQUIRE);
+  if (g.reply_write + skip + n - read > size) {
+    return false;
+  }
+  uint32_t const off = skip ? 0 : pos;
+  memcpy((char *)h + h->reply_area_offset + off, buf, n);
+  g.reply_write += skip + n;
+  *offset = off;
+  return true;
+}
+
+static bool next_doorbell(struct bridge_child_request *const req) {
+  while (!doorbell_wait_request(g.bell, STDIN_CHECK_MS)) {
+    if (stdin_closed()) {
+      return false;
+    }
+  }
+  uint32_t offset, size;
+  doorbell_get_request(g.bell, &offset, &size);
+  req->buf = request_area(offset, size);
+  req->len = (int32_t)size;
+  return req->buf != NULL;
+}
+
+static bool next_pipe(struct bridge_child_request *const req) {
+  if (g.in_begin == g.in_end) {
+    g.in_begin = 0;
+    g.in_end = 0;
+  }
+  int32_t len;
+  if (!fill(sizeof(len))) {
+    return false;
+  }
+  memcpy(&len, g.in + g.in_begin, sizeof(len));
+  g.in_begin += sizeof(len);
+  if (len == SHARE_MEM_CHANNEL_FRAME) {
+    uint32_t ref[2];
+    if (!fill(sizeof(ref))) {
+      return false;
+    }
+    memcpy(ref, g.in + g.in_begin, sizeof(ref));
+    g.in_begin += sizeof(ref);
+    req->buf = request_area(ref[0], ref[1]);
+    req->len = (int32_t)ref[1];
+    return req->buf != NULL;
+  }
+  if (len < 0 || !fill((size_t)len)) {
+    return false;
+  }
+  req->buf = g.in + g.in_begin;
+  req->len = len;
+  g.in_begin += (size_t)len;
+  return true;
+}
+
+bool bridge_child_init(void) {
+#ifdef _WIN32
+  g.stdin_handle = GetStdHandle(STD_INPUT_HANDLE);
+  g.stdout_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+#endif
+  // A child started without BRIDGE_FMO still gets the requests.
+  if (!get_name()) {
+    return true;
+  }
+  return open_view();
+}
+
+bool bridge_child_next(struct bridge_child_request *const req) {
+  if (!check_view()) {
+    return false;
+  }
+  if (!(g.bell ? next_doorbell(req) : next_pipe(req))) {
+    return false;
+  }
+  req->header = g.view;
+  req->pixels = g.view ? (char *)g.view + g.view->header_size : NULL;
+  return true;
+}
+
+bool bridge_child_reply(void const *const buf, int32_t const len) {
+  if (len < 0) {
+    return false;
+  }
+  uint32_t offset;
+  if (g.bell) {
+    // Every reply goes through the reply area, which the bridge has emptied before sending the request.
+    if (!put_reply(buf, (uint32_t)len, &offset)) {
+      return false;
+    }
+    doorbell_ring_reply(g.bell, offset, (uint32_t)len);
+    return true;
+  }
+  if ((size_t)len > sizeof(g.out) - sizeof(len) && put_reply(buf, (uint32_t)len, &offset)) {
+    struct {
+      int32_t len;
+      uint32_t offset;
+      uint32_t size;
+    } const frame = {SHARE_MEM_CHANNEL_FRAME, offset, (uint32_t)len};
+    return write_all(&frame, sizeof(frame));
+  }
+  if ((size_t)len <= sizeof(g.out) - sizeof(len)) {
+    memcpy(g.out, &len, sizeof(len));
+    if (len) {
+      memcpy(g.out + sizeof(len), buf, (size_t)len);
+    }
+    return write_all(g.out, sizeof(len) + (size_t)len);
+  }
+  return write_all(&len, sizeof(len)) && write_all(buf, (size_t)len);
+}
+
+void bridge_child_exit(void) {
+  close_view();
+  free(g.in);
+  g.in = NULL;
+  g.in_cap = 0;
+  g.in_begin = 0;
+  g.in_end = 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// The child side of the protocol, for the executables started by bridge.dll or the bridge library.
+// It implements what the sample in README.md does by hand without its per-request costs:
+// BRIDGE_FMO is mapped once, requests are read with raw reads into a buffer that is reused,
+// and the channel and the doorbell are used when the bridge has enabled them.
+//
+// A child is single threaded, so the state is global. stdin and stdout belong to the SDK,
+// do not use them through stdio as well.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bridge.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bridge_child_request {
+  // The payload, valid until the next call to bridge_child_reply or bridge_child_next.
+  void const *buf;
+  int32_t len;
+  // The shared memory, NULL if the child was not started with BRIDGE_FMO.
+  struct share_mem_header *header;
+  // The pixels, header + header->header_size.
+  void *pixels;
+};
+
+// Maps BRIDGE_FMO and opens the doorbell if the bridge has enabled it.
+bool bridge_child_init(void);
+// Blocks until the next request arrives.
+// Returns false once the bridge has closed stdin, which is when the child should exit, or if the request is broken.
+bool bridge_child_next(struct bridge_child_request *const req);
+// Answers the request returned by the last bridge_child_next.
+bool bridge_child_reply(void const *const buf, int32_t const len);
+void bridge_child_exit(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,19 +3,141 @@
 #include "hashmap.h"
 #include "threads.h"
 
+#include "cache.h"
+#include "channel.h"
+#include "doorbell.h"
+#include "fmo.h"
+#include "hash.h"
+#include "pixfmt.h"
 #include "ods.h"
 #include "process.h"
-#include "version.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
 
-struct hash_map_value {
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#endif
+
+#define MAX_POOL_SIZE 64
+// Address space the shared memory of one pool may take. Every instance maps its own,
+// so a 32-bit host such as AviUtl would run out of it with large pools at large frame sizes.
+#if SIZE_MAX > UINT32_MAX
+#  define MAX_POOL_MAPPING SIZE_MAX
+#else
+#  define MAX_POOL_MAPPING ((size_t)512 * 1024 * 1024)
+#endif
+#define DEFAULT_CACHE_BUDGET (64 * 1024 * 1024)
+#define TILE_SIZE 64
+#define TILE_HASH_SEED 0x6b43a9b5
+#define MAX_DIRTY_RECTS 64
+// Smaller payloads are cheaper to send through the pipe than to copy twice.
+#define CHANNEL_MIN_PAYLOAD 4096
+// Channel size used by the doorbell when none was set, every payload has to fit in it.
+#define DOORBELL_CHANNEL_SIZE (1024 * 1024)
+
+struct instance {
+  // Set while the body of fmo holds the pixels hashed to body_hash in body_format.
+  uint64_t body_hash;
+  int32_t body_width;
+  int32_t body_height;
+  enum pixel_format body_format;
   struct process *value;
+  // Serializes everything done with value, including spawning it.
+  mtx_t mtx;
+  // Shared with the other instances of the same executable.
+  struct stats *stats;
+  // The key of the executable in g_process_map, not NUL-terminated.
+  char const *exe_path;
+  size_t exe_path_len;
+  // Each child gets its own shared memory so pixel transfers to different children do not conflict.
+  // Children that follow the README read BRIDGE_FMO into char[32], so it must not exceed 31 characters.
+  wchar_t fmo_name[32];
+  struct fmo *fmo;
+  // Requested size of the channel and the size fmo was created with.
+  size_t channel_size;
+  size_t fmo_channel_size;
+  struct channel channel;
+  // The doorbell of the current fmo.
+  struct doorbell *bell;
+  // Requests already sent to value, in the order their replies will arrive.
+  struct bridge_ticket *pending_head;
+  struct bridge_ticket *pending_tail;
+  enum wait_policy wait_policy;
+  uint32_t wait_spins;
+  // Warm-up requests sent by bridge_preload that have not been answered yet.
+  int warmups_pending;
+  int warmup_err;
+  // Hashes of the tiles in the shared memory, valid only while tiles_valid is set.
+  uint64_t *tile_hashes;
+  size_t tile_hashes_cap;
+  int32_t tiles_width;
+  int32_t tiles_height;
+  bool tiles_valid;
+  bool body_valid;
+  // Set once a child has been started, later ones count as respawns.
+  bool spawned;
+  // Whether the next child is woken through the doorbell.
+  bool doorbell;
+  // Set when the pool shrinks, calls that raced with it have to pick another instance.
+  bool retired;
+  // Whether value is started without a reader thread, see process_start.
+  bool sync;
+  uint8_t padding[6];
+};
+
+struct hash_map_value {
+  // Guarded by g_mutex.
+  struct instance *instances[MAX_POOL_SIZE];
+  size_t num_instances;
+  size_t allocated_instances;
+  size_t next;
+  size_t channel_size;
+  enum wait_policy wait_policy;
+  uint32_t wait_spins;
+  struct stats *stats;
+  // The key follows this struct.
+  size_t exe_path_len;
+  bool sync;
+  bool doorbell;
+  uint8_t padding[2];
+};
+
+struct bridge_ticket {
+  // When the request was sent, 0 if statistics and tracing were disabled.
+  uint64_t sent;
+  struct instance *inst;
+  struct bridge_ticket *next;
+  struct call_mem mem;
+  // Not NULL if the reply should be stored in the cache.
+  struct cache_pending *cache;
+  int err;
+  void *r;
+  int32_t rlen;
+  // Set if the request payload occupies the channel until the reply arrives.
+  uint32_t channel_end;
+  bool has_channel_end;
+  bool has_mem;
+  bool done;
+  bool abandoned;
+  bool warmup;
+  bool unchanged;
+  uint8_t padding[6];
 };
 
-static WCHAR g_mapped_file_name[32];
-static HANDLE g_mapped_file = NULL;
-static int g_bufsize = 0;
-static void *g_view = NULL;
+static uint32_t g_max_width = 0;
+static uint32_t g_max_height = 0;
+// Numbers the shared memory of this process, taken by instances that hold only their own mtx.
+static atomic_uint g_serial = 0;
 static struct hashmap_s g_process_map = {0};
+// Guards g_process_map and pool bookkeeping only, never held while talking to a child.
 static mtx_t g_mutex = {0};
 
 bool bridge_init(int32_t const max_width, int32_t const max_height) {
@@ -25,138 +147,1387 @@ bool bridge_init(int32_t const max_width, int32_t const max_height) {
   if (hashmap_create(2, &g_process_map) != 0) {
     return false;
   }
-  mtx_init(&g_mutex, mtx_plain | mtx_recursive);
-
-  int const header_size = sizeof(struct share_mem_header);
-  int const body_size = max_width * 4 * max_height;
-  wsprintfW(g_mapped_file_name, L"aviutl_bridge_fmo_%08x", GetCurrentProcessId());
-  HANDLE mapped_file = CreateFileMappingW(
-      INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)(header_size + body_size), g_mapped_file_name);
-  if (!mapped_file) {
+  if (!cache_init(DEFAULT_CACHE_BUDGET)) {
+    hashmap_destroy(&g_process_map);
     return false;
   }
-
-  void *const view = MapViewOfFile(mapped_file, FILE_MAP_WRITE, 0, 0, 0);
-  if (!view) {
-    CloseHandle(mapped_file);
-    return false;
+  mtx_init(&g_mutex, mtx_plain);
+  g_max_width = (uint32_t)max_width;
+  g_max_height = (uint32_t)max_height;
+  trace_init();
+  char const *const trace_path = getenv("BRIDGE_TRACE");
+  if (trace_path && trace_path[0]) {
+    trace_start(trace_path);
   }
-
-  g_mapped_file = mapped_file;
-  g_view = view;
-  g_bufsize = header_size + body_size;
-  struct share_mem_header *const v = view;
-  v->header_size = header_size;
-  v->body_size = (uint32_t)body_size;
-  v->version = 1;
-  v->width = (uint32_t)max_width;
-  v->height = (uint32_t)max_height;
   return true;
 }
 
+// inst->mtx must be held if other threads can see inst.
+static void instance_stop(struct instance *const inst) {
+  // We cannot wait for replies here, so orphan the tickets that are still in flight.
+  struct bridge_ticket *t = inst->pending_head;
+  while (t) {
+    struct bridge_ticket *const next = t->next;
+    if (t->cache) {
+      cache_pending_destroy(t->cache);
+      t->cache = NULL;
+    }
+    if (t->abandoned) {
+      free(t);
+    } else {
+      t->inst = NULL;
+      t->next = NULL;
+      t->done = true;
+      t->err = ECALL_NOT_INITIALIZED;
+    }
+    t = next;
+  }
+  inst->pending_head = NULL;
+  inst->pending_tail = NULL;
+  inst->warmups_pending = 0;
+  if (inst->value) {
+    process_finish(inst->value);
+    inst->value = NULL;
+  }
+}
+
 static int delete_all_callback(void *const context, void *const value) {
   (void)context;
   struct hash_map_value *hmv = value;
-  process_finish(hmv->value);
+  for (size_t i = 0; i < hmv->allocated_instances; ++i) {
+    struct instance *const inst = hmv->instances[i];
+    instance_stop(inst);
+    if (inst->bell) {
+      doorbell_destroy(inst->bell);
+    }
+    if (inst->fmo) {
+      fmo_destroy(inst->fmo);
+    }
+    mtx_destroy(&inst->mtx);
+    free(inst->tile_hashes);
+    free(inst);
+  }
+  stats_destroy(hmv->stats);
   free(value);
   return 1;
 }
 
 bool bridge_exit(void) {
+  // Writes the file if tracing is still running, before the executable names it refers to are freed.
+  trace_exit();
   mtx_lock(&g_mutex);
   hashmap_iterate(&g_process_map, delete_all_callback, NULL);
   hashmap_destroy(&g_process_map);
-  if (g_view) {
-    UnmapViewOfFile(g_view);
-    g_view = NULL;
+  cache_exit();
+  g_max_width = 0;
+  g_max_height = 0;
+  mtx_unlock(&g_mutex);
+  mtx_destroy(&g_mutex);
+  return true;
+}
+
+static void update_fmo_name(struct instance *const inst) {
+#ifdef _WIN32
+  unsigned int const pid = (unsigned int)GetCurrentProcessId();
+#else
+  unsigned int const pid = (unsigned int)getpid();
+#endif
+  unsigned int const serial = atomic_fetch_add_explicit(&g_serial, 1, memory_order_relaxed) + 1;
+  swprintf(inst->fmo_name, sizeof(inst->fmo_name) / sizeof(inst->fmo_name[0]), L"aviutl_bridge_%08x_%x", pid, serial);
+}
+
+// g_mutex must be held.
+static struct instance *instance_create(void) {
+  struct instance *const inst = calloc(1, sizeof(struct instance));
+  if (!inst) {
+    return NULL;
   }
-  if (g_mapped_file) {
-    CloseHandle(g_mapped_file);
-    g_mapped_file = NULL;
+  if (mtx_init(&inst->mtx, mtx_plain) != thrd_success) {
+    free(inst);
+    return NULL;
   }
-  mtx_destroy(&g_mutex);
+  update_fmo_name(inst);
+  return inst;
+}
+
+// g_mutex must be held.
+static bool pool_grow(struct hash_map_value *const hmv, size_t const n) {
+  while (hmv->allocated_instances < n) {
+    struct instance *const inst = instance_create();
+    if (!inst) {
+      return false;
+    }
+    inst->sync = hmv->sync;
+    inst->doorbell = hmv->doorbell;
+    inst->channel_size = hmv->channel_size;
+    inst->wait_policy = hmv->wait_policy;
+    inst->wait_spins = hmv->wait_spins;
+    inst->stats = hmv->stats;
+    inst->exe_path = (char const *)(hmv + 1);
+    inst->exe_path_len = hmv->exe_path_len;
+    hmv->instances[hmv->allocated_instances++] = inst;
+  }
+  for (size_t i = hmv->num_instances; i < n; ++i) {
+    hmv->instances[i]->retired = false;
+  }
+  if (hmv->num_instances < n) {
+    hmv->num_instances = n;
+  }
+  return true;
+}
+
+// g_mutex must be held.
+static struct hash_map_value *find_or_insert(char const *const exe_path) {
+  const size_t exe_path_len = strlen(exe_path);
+  struct hash_map_value *hmv = hashmap_get(&g_process_map, exe_path, exe_path_len);
+  if (hmv) {
+    return hmv;
+  }
+  hmv = calloc(1, sizeof(struct hash_map_value) + exe_path_len);
+  if (!hmv) {
+    return NULL;
+  }
+  hmv->wait_policy = WAIT_POLICY_ADAPTIVE;
+  hmv->wait_spins = BRIDGE_DEFAULT_SPINS;
+  hmv->exe_path_len = exe_path_len;
+  hmv->stats = stats_create();
+  if (!hmv->stats) {
+    free(hmv);
+    return NULL;
+  }
+  if (!pool_grow(hmv, 1)) {
+    stats_destroy(hmv->stats);
+    free(hmv);
+    return NULL;
+  }
+  char *key = (char *)(hmv + 1);
+  memcpy(key, exe_path, exe_path_len);
+  if (hashmap_put(&g_process_map, key, exe_path_len, hmv) != 0) {
+    struct instance *const inst = hmv->instances[0];
+    mtx_destroy(&inst->mtx);
+    free(inst);
+    stats_destroy(hmv->stats);
+    free(hmv);
+    return NULL;
+  }
+  return hmv;
+}
+
+// Returns 0 if neither statistics nor tracing are enabled, the measure functions ignore such a start.
+static inline uint64_t measure_begin(void) { return stats_enabled() || trace_enabled() ? timer_now_ns() : 0; }
+
+static void measure_end(struct instance const *const inst,
+                        enum bridge_phase const phase,
+                        uint64_t const start,
+                        uint64_t const bytes) {
+  if (!start) {
+    return;
+  }
+  uint64_t const end = timer_now_ns();
+  stats_record(inst->stats, phase, end > start ? end - start : 0);
+  trace_record(bridge_phase_name(phase), inst->exe_path, inst->exe_path_len, start, end, bytes);
+}
+
+// For spans that have no phase in the statistics.
+static void measure_trace(struct instance const *const inst,
+                          char const *const name,
+                          uint64_t const start,
+                          uint64_t const bytes) {
+  if (start) {
+    trace_record(name, inst->exe_path, inst->exe_path_len, start, timer_now_ns(), bytes);
+  }
+}
+
+// Returns NULL if exe_path has never been used.
+static struct hash_map_value *find_existing(char const *const exe_path) {
+  const size_t exe_path_len = strlen(exe_path);
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = hashmap_get(&g_process_map, exe_path, exe_path_len);
+  mtx_unlock(&g_mutex);
+  // hmv and its key live until bridge_exit.
+  return hmv;
+}
+
+// Picks an instance for exe_path and returns it locked.
+// An idle instance is preferred, otherwise instances are used in turn.
+static struct instance *acquire_instance(char const *const exe_path) {
+  for (;;) {
+    mtx_lock(&g_mutex);
+    struct hash_map_value *const hmv = find_or_insert(exe_path);
+    if (!hmv) {
+      mtx_unlock(&g_mutex);
+      return NULL;
+    }
+    struct instance *inst = NULL;
+    bool locked = false;
+    for (size_t i = 0; i < hmv->num_instances; ++i) {
+      struct instance *const candidate = hmv->instances[i];
+      if (mtx_trylock(&candidate->mtx) != thrd_success) {
+        continue;
+      }
+      if (!candidate->pending_head) {
+        inst = candidate;
+        locked = true;
+        break;
+      }
+      mtx_unlock(&candidate->mtx);
+    }
+    if (!inst) {
+      inst = hmv->instances[hmv->next % hmv->num_instances];
+      hmv->next = (hmv->next + 1) % hmv->num_instances;
+    }
+    mtx_unlock(&g_mutex);
+    if (!locked) {
+      mtx_lock(&inst->mtx);
+    }
+    if (!inst->retired) {
+      return inst;
+    }
+    mtx_unlock(&inst->mtx);
+  }
+}
+
+static inline size_t tile_count(int32_t const size) { return (size_t)((size + TILE_SIZE - 1) / TILE_SIZE); }
+
+static inline void *get_pixels(struct share_mem_header *const v) { return (uint8_t *)v + v->header_size; }
+
+static size_t effective_channel_size(size_t const channel_size, bool const doorbell) {
+  return doorbell && channel_size == 0 ? DOORBELL_CHANNEL_SIZE : channel_size;
+}
+
+struct fmo_layout {
+  size_t size;
+  size_t body_size;
+  size_t rects_offset;
+  size_t channel_offset;
+  uint32_t header_size;
+  uint32_t area_size;
+};
+
+static void get_fmo_layout(size_t const channel_size, struct fmo_layout *const l) {
+  // The dirty tile bitmap and the dirty rects sit between the header and the pixels,
+  // which are kept 64-byte aligned.
+  size_t const bitmap_size = (tile_count((int32_t)g_max_width) * tile_count((int32_t)g_max_height) + 7) / 8;
+  l->rects_offset = (sizeof(struct share_mem_header) + bitmap_size + 3) & ~(size_t)3;
+  size_t const rects_size = MAX_DIRTY_RECTS * sizeof(struct share_mem_rect);
+  l->header_size = (uint32_t)((l->rects_offset + rects_size + 63) & ~(size_t)63);
+  l->body_size = (size_t)g_max_width * 4 * (size_t)g_max_height;
+  l->channel_offset = (l->header_size + l->body_size + 63) & ~(size_t)63;
+  l->area_size = channel_area_size(channel_size / 2);
+  l->size = l->area_size ? l->channel_offset + (size_t)l->area_size * 2 : l->header_size + l->body_size;
+}
+
+// Whether n instances with the given settings stay within MAX_POOL_MAPPING, a single one is always allowed.
+static bool pool_fits(size_t const n, size_t const channel_size, bool const doorbell) {
+  struct fmo_layout l;
+  get_fmo_layout(effective_channel_size(channel_size, doorbell), &l);
+  return n <= 1 || n <= MAX_POOL_MAPPING / l.size;
+}
+
+static bool prepare_fmo(struct instance *const inst) {
+  size_t const channel_size = effective_channel_size(inst->channel_size, inst->doorbell);
+  if (inst->fmo) {
+    // A previous child may still be waiting on the doorbell and must not see the requests for the next one,
+    // so such fmo is never reused.
+    if (inst->fmo_channel_size == channel_size && !inst->doorbell && !inst->bell) {
+      return true;
+    }
+    // The previous child may still hold the old one, so the new one needs another name.
+    if (inst->bell) {
+      doorbell_destroy(inst->bell);
+      inst->bell = NULL;
+    }
+    fmo_destroy(inst->fmo);
+    inst->fmo = NULL;
+    update_fmo_name(inst);
+  }
+  struct fmo_layout l;
+  get_fmo_layout(channel_size, &l);
+  struct fmo *const fmo = fmo_create(inst->fmo_name, l.size);
+  if (!fmo) {
+    return false;
+  }
+  struct share_mem_header *const v = fmo_view(fmo);
+  v->header_size = l.header_size;
+  v->body_size = (uint32_t)l.body_size;
+  v->version = 8;
+  v->width = g_max_width;
+  v->height = g_max_height;
+  v->batch_size = 1;
+  v->dirty_offset = sizeof(struct share_mem_header);
+  v->dirty_rects_offset = (uint32_t)l.rects_offset;
+  v->max_dirty_rects = MAX_DIRTY_RECTS;
+  v->num_dirty_rects = SHARE_MEM_DIRTY_RECTS_ALL;
+  if (l.area_size) {
+    v->request_area_offset = (uint32_t)l.channel_offset;
+    v->request_area_size = l.area_size;
+    v->reply_area_offset = (uint32_t)l.channel_offset + l.area_size;
+    v->reply_area_size = l.area_size;
+    if (inst->doorbell) {
+      inst->bell = doorbell_create(inst->fmo_name, v);
+      if (!inst->bell) {
+        fmo_destroy(fmo);
+        return false;
+      }
+    }
+  }
+  inst->fmo = fmo;
+  inst->fmo_channel_size = channel_size;
+  return true;
+}
+
+// Copies only the tiles whose hash differs from the last upload and marks them in the dirty tile bitmap.
+// Returns false if the image does not fit in the bitmap, the caller has to upload everything then.
+// *uploaded receives the number of bytes copied.
+static bool upload_delta(struct instance *const inst,
+                         struct share_mem_header *const v,
+                         struct call_mem const *const mem,
+                         size_t *const uploaded) {
+  size_t const tiles_x = tile_count(mem->width), tiles_y = tile_count(mem->height);
+  size_t const n = tiles_x * tiles_y;
+  if (v->dirty_offset + (n + 7) / 8 > v->header_size) {
+    return false;
+  }
+  if (inst->tile_hashes_cap < n) {
+    uint64_t *const hashes = realloc(inst->tile_hashes, n * sizeof(uint64_t));
+    if (!hashes) {
+      return false;
+    }
+    inst->tile_hashes = hashes;
+    inst->tile_hashes_cap = n;
+  }
+  bool const valid = inst->tiles_valid && inst->tiles_width == mem->width && inst->tiles_height == mem->height;
+  uint8_t *const bitmap = (uint8_t *)v + v->dirty_offset;
+  memset(bitmap, 0, (n + 7) / 8);
+  size_t const stride = (size_t)mem->width * 4;
+  uint8_t const *const src = mem->buf;
+  uint8_t *const dest = get_pixels(v);
+  *uploaded = 0;
+  for (size_t ty = 0, i = 0; ty < tiles_y; ++ty) {
+    size_t const y = ty * TILE_SIZE;
+    size_t const h = (size_t)mem->height - y < TILE_SIZE ? (size_t)mem->height - y : TILE_SIZE;
+    for (size_t tx = 0; tx < tiles_x; ++tx, ++i) {
+      size_t const x = tx * TILE_SIZE;
+      size_t const w = (size_t)mem->width - x < TILE_SIZE ? (size_t)mem->width - x : TILE_SIZE;
+      size_t const offset = y * stride + x * 4;
+      uint64_t const hash = cyrb64_rect(src + offset, stride, w, h, TILE_HASH_SEED);
+      if (valid && inst->tile_hashes[i] == hash) {
+        continue;
+      }
+      inst->tile_hashes[i] = hash;
+      bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+      for (size_t row = 0; row < h; ++row) {
+        memcpy(dest + offset + row * stride, src + offset + row * stride, w * 4);
+      }
+      *uploaded += w * 4 * h;
+    }
+  }
+  inst->tiles_width = mem->width;
+  inst->tiles_height = mem->height;
+  inst->tiles_valid = true;
+  v->tile_size = TILE_SIZE;
+  v->tiles_x = (uint32_t)tiles_x;
+  v->tiles_y = (uint32_t)tiles_y;
   return true;
 }
 
-static int bridge_call_core(char const *const exe_path,
+// Returns NULL if s cannot be represented in the current code page.
+static wchar_t *to_wide(char const *const s) {
+#ifdef _WIN32
+  const int len = lstrlenA(s);
+  int buflen = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, s, len, NULL, 0);
+  wchar_t *r = malloc(sizeof(wchar_t) * (size_t)(buflen + 1));
+  if (!r) {
+    return NULL;
+  }
+  if (MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, s, len, r, buflen) == 0) {
+    free(r);
+    return NULL;
+  }
+  r[buflen] = '\0';
+#else
+  size_t const buflen = mbstowcs(NULL, s, 0);
+  if (buflen == (size_t)-1) {
+    return NULL;
+  }
+  wchar_t *r = malloc(sizeof(wchar_t) * (buflen + 1));
+  if (!r) {
+    return NULL;
+  }
+  mbstowcs(r, s, buflen + 1);
+#endif
+  return r;
+}
+
+static int spawn(struct instance *const inst, char const *const exe_path) {
+  // The child may open BRIDGE_FMO right after it starts, so it has to exist beforehand.
+  if (!prepare_fmo(inst)) {
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  wchar_t *const wpath = to_wide(exe_path);
+  if (!wpath) {
+    return ECALL_FAILED_TO_CONVERT_EXE_PATH;
+  }
+  channel_init(&inst->channel, fmo_view(inst->fmo));
+  struct process *p = process_start(wpath,
+                                    L"BRIDGE_FMO",
+                                    inst->fmo_name,
+                                    inst->sync,
+                                    channel_enabled(&inst->channel) ? &inst->channel : NULL,
+                                    inst->bell);
+  free(wpath);
+  if (!p) {
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  process_close_stderr(p);
+  process_set_wait_policy(p, inst->wait_policy, inst->wait_spins);
+  inst->value = p;
+  // A new child has not seen anything yet.
+  inst->tiles_valid = false;
+  inst->body_valid = false;
+  return ECALL_OK;
+}
+
+// Copies the pixels the child reported as modified into mem->buf.
+// Returns the number of bytes written to mem->buf, 0 if nothing was modified.
+static size_t write_back(struct share_mem_header *const v, struct call_mem const *const mem) {
+  size_t const width = (size_t)mem->width, height = (size_t)mem->height;
+  uint32_t const n = v->num_dirty_rects;
+  if (n == 0) {
+    return 0;
+  }
+  if (n > v->max_dirty_rects) {
+    pixfmt_decode(mem->format, mem->buf, get_pixels(v), width, height, 0, 0, width, height);
+    return width * 4 * height;
+  }
+  size_t written = 0;
+  struct share_mem_rect const *const rects = (void const *)((uint8_t const *)v + v->dirty_rects_offset);
+  for (uint32_t i = 0; i < n; ++i) {
+    // The rects come from the child, so never trust them.
+    size_t const x = rects[i].x, y = rects[i].y;
+    if (x >= width || y >= height) {
+      continue;
+    }
+    size_t const w = rects[i].width < width - x ? rects[i].width : width - x;
+    size_t const h = rects[i].height < height - y ? rects[i].height : height - y;
+    pixfmt_decode(mem->format, mem->buf, get_pixels(v), width, height, x, y, w, h);
+    written += w * 4 * h;
+  }
+  return written;
+}
+
+// Receives the reply for the oldest pending ticket.
+// inst->mtx must be held and inst->pending_head must not be NULL.
+static void complete_head(struct instance *const inst) {
+  struct bridge_ticket *const t = inst->pending_head;
+  inst->pending_head = t->next;
+  if (!inst->pending_head) {
+    inst->pending_tail = NULL;
+  }
+  t->next = NULL;
+  void *rbuf;
+  size_t rbuflen;
+  uint64_t const read_start = measure_begin();
+  int const read_err = process_read(inst->value, &rbuf, &rbuflen);
+  measure_trace(inst, "read", read_start, read_err == 0 ? rbuflen : 0);
+  measure_end(inst, BRIDGE_PHASE_WAIT, t->sent, read_err == 0 ? rbuflen : 0);
+  if (t->has_channel_end) {
+    // The child has finished reading the request when it replies.
+    channel_release(&inst->channel, t->channel_end);
+  }
+  if (read_err != 0) {
+    t->err = ECALL_FAILED_TO_RECEIVE_COMMAND;
+    if (t->cache) {
+      cache_pending_destroy(t->cache);
+      t->cache = NULL;
+    }
+  } else {
+    bool const writable = t->has_mem && t->mem.mode & MEM_MODE_WRITE;
+    size_t const pixels_len = (size_t)t->mem.width * 4 * (size_t)t->mem.height;
+    size_t written = 0;
+    if (writable) {
+      uint64_t const start = measure_begin();
+      written = write_back(fmo_view(inst->fmo), &t->mem);
+      measure_end(inst, BRIDGE_PHASE_WRITE_BACK, start, written);
+      stats_add(inst->stats, STATS_BYTES_OUT, written);
+      t->unchanged = !written;
+    }
+    // Pixels outside the dirty rects are still the caller's. The key covers them only if they were sent,
+    // otherwise a hit would hand them to another caller.
+    if (t->cache && writable && !(t->mem.mode & MEM_MODE_READ) && written != pixels_len) {
+      cache_pending_destroy(t->cache);
+      t->cache = NULL;
+    }
+    if (t->cache) {
+      cache_insert(t->cache, rbuf, rbuflen, writable ? t->mem.buf : NULL, writable ? pixels_len : 0);
+      t->cache = NULL;
+    }
+    stats_add(inst->stats, STATS_BYTES_OUT, rbuflen);
+    t->r = rbuf;
+    t->rlen = (int32_t)rbuflen;
+    t->err = ECALL_OK;
+  }
+  t->done = true;
+  if (t->warmup) {
+    --inst->warmups_pending;
+    if (t->err != ECALL_OK) {
+      inst->warmup_err = t->err;
+    }
+  }
+  if (t->abandoned) {
+    process_free_buffer(t->r);
+    free(t);
+  }
+}
+
+// inst->mtx must be held.
+static int prepare_process(struct instance *const inst, char const *const exe_path) {
+  if (inst->value && !process_isrunning(inst->value)) {
+    // It seems process is already dead, but it may have replied before exiting.
+    while (inst->pending_head) {
+      complete_head(inst);
+    }
+    process_finish(inst->value);
+    inst->value = NULL;
+  }
+  if (!inst->value) {
+    uint64_t const start = measure_begin();
+    int const err = spawn(inst, exe_path);
+    if (err == ECALL_OK) {
+      measure_end(inst, BRIDGE_PHASE_SPAWN, start, 0);
+      stats_add(inst->stats, STATS_SPAWNS, 1);
+      if (inst->spawned) {
+        stats_add(inst->stats, STATS_RESPAWNS, 1);
+      }
+      inst->spawned = true;
+    }
+    return err;
+  }
+  return ECALL_OK;
+}
+
+// inst->mtx must be held.
+static void push_pending(struct instance *const inst, struct bridge_ticket *const t) {
+  t->inst = inst;
+  if (inst->pending_tail) {
+    inst->pending_tail->next = t;
+  } else {
+    inst->pending_head = t;
+  }
+  inst->pending_tail = t;
+}
+
+// inst->mtx must be held.
+static int bridge_call_core(struct instance *const inst,
+                            char const *const exe_path,
                             void const *const buf,
                             int32_t const len,
                             struct call_mem *const mem,
-                            void **const r,
-                            int32_t *const rlen) {
-  if (g_bufsize == 0 || !g_view) {
+                            int32_t const flags,
+                            uint64_t const *const pixel_hash,
+                            struct cache_pending *const cache,
+                            struct bridge_ticket **const ticket) {
+  int const err = prepare_process(inst, exe_path);
+  if (err != ECALL_OK) {
+    return err;
+  }
+  struct share_mem_header *const header = fmo_view(inst->fmo);
+  if (header->batch_size != 1) {
+    // The child may still be counting down the previous batch.
+    while (inst->pending_head) {
+      complete_head(inst);
+    }
+    header->batch_size = 1;
+  }
+  if (mem) {
+    // There is only one pixel buffer per child, wait until earlier requests are finished with it.
+    while (inst->pending_head) {
+      complete_head(inst);
+    }
+    struct share_mem_header *v = fmo_view(inst->fmo);
+    if (mem->width <= 0 || mem->height <= 0 ||
+        pixfmt_size(mem->format, (size_t)mem->width, (size_t)mem->height) > v->body_size) {
+      return ECALL_IMAGE_TOO_LARGE;
+    }
+    bool const readable = mem->mode & MEM_MODE_READ;
+    // Whether the pixels are the ones last uploaded, in which case the generation stays.
+    bool const same = readable && pixel_hash && inst->body_valid && inst->body_hash == *pixel_hash &&
+                      inst->body_width == mem->width && inst->body_height == mem->height &&
+                      inst->body_format == mem->format;
+    // The child sets num_dirty_rects to 0 if it left the pixels of the previous request alone.
+    bool const intact = same && v->num_dirty_rects == 0;
+    size_t const width = (size_t)mem->width, height = (size_t)mem->height;
+    v->width = (uint32_t)width;
+    v->height = (uint32_t)height;
+    v->format = (uint32_t)mem->format;
+    v->num_dirty_rects = SHARE_MEM_DIRTY_RECTS_ALL;
+    bool const delta = flags & CALL_FLAG_DELTA && (mem->mode & (MEM_MODE_READ | MEM_MODE_WRITE)) == MEM_MODE_READ &&
+                       mem->format == PIXEL_FORMAT_BGRA;
+    uint64_t const start = measure_begin();
+    size_t uploaded = 0;
+    bool fresh = false;
+    if (intact) {
+      // Nothing to upload, and no tile has changed either.
+      if (v->tile_size) {
+        memset((uint8_t *)v + v->dirty_offset, 0, ((size_t)v->tiles_x * (size_t)v->tiles_y + 7) / 8);
+      }
+    } else if (delta && upload_delta(inst, v, mem, &uploaded)) {
+      fresh = uploaded && !same;
+    } else {
+      v->tile_size = 0;
+      if (readable) {
+        pixfmt_encode(mem->format, get_pixels(v), mem->buf, width, height, 0, 0, width, height);
+        uploaded = width * 4 * height;
+        fresh = !same;
+      }
+      // The pixels may be rewritten by the child, so the tile hashes cannot be trusted anymore.
+      inst->tiles_valid = false;
+    }
+    if (fresh) {
+      ++v->generation;
+      v->has_content_hash = 0;
+      v->content_hash = 0;
+    }
+    if (readable && pixel_hash) {
+      inst->body_valid = true;
+      inst->body_hash = *pixel_hash;
+      inst->body_width = mem->width;
+      inst->body_height = mem->height;
+      inst->body_format = mem->format;
+      v->has_content_hash = 1;
+      v->content_hash = *pixel_hash;
+    } else if (fresh || !readable) {
+      // Unknown pixels were uploaded, or the child is about to write its own.
+      inst->body_valid = false;
+    }
+    measure_end(inst, BRIDGE_PHASE_UPLOAD, start, uploaded);
+    stats_add(inst->stats, STATS_BYTES_IN, uploaded);
+  }
+  if (process_issync(inst->value)) {
+    // Nobody reads the reply of a synchronous process until we ask for it, so keep only one in flight.
+    while (inst->pending_head) {
+      complete_head(inst);
+    }
+  }
+  struct bridge_ticket *const t = calloc(1, sizeof(struct bridge_ticket));
+  if (!t) {
+    return ECALL_FAILED_TO_SEND_COMMAND;
+  }
+  uint64_t const start = measure_begin();
+  uint32_t offset;
+  if (channel_enabled(&inst->channel) && len >= CHANNEL_MIN_PAYLOAD &&
+      channel_put(&inst->channel, buf, (size_t)len, &offset, &t->channel_end)) {
+    t->has_channel_end = true;
+    if (process_write_ref(inst->value, offset, (uint32_t)len) != 0) {
+      free(t);
+      return ECALL_FAILED_TO_SEND_COMMAND;
+    }
+  } else if (process_write(inst->value, buf, (size_t)len) != 0) {
+    free(t);
+    return ECALL_FAILED_TO_SEND_COMMAND;
+  }
+  measure_end(inst, BRIDGE_PHASE_WRITE, start, (uint64_t)len);
+  stats_add(inst->stats, STATS_CALLS, 1);
+  stats_add(inst->stats, STATS_BYTES_IN, (uint64_t)len);
+  t->sent = measure_begin();
+  if (mem) {
+    t->mem = *mem;
+    t->has_mem = true;
+  }
+  t->cache = cache;
+  push_pending(inst, t);
+  *ticket = t;
+  return ECALL_OK;
+}
+
+// inst->mtx must be held.
+static int bridge_call_batch_core(struct instance *const inst,
+                                  char const *const exe_path,
+                                  void const *const *const bufs,
+                                  int32_t const *const lens,
+                                  size_t const n,
+                                  void **const r,
+                                  int32_t *const rlen) {
+  int err = prepare_process(inst, exe_path);
+  if (err != ECALL_OK) {
+    return err;
+  }
+  struct bridge_ticket *const tickets = calloc(n, sizeof(struct bridge_ticket));
+  size_t *const slens = malloc(n * sizeof(size_t));
+  if (!tickets || !slens) {
+    free(slens);
+    free(tickets);
+    return ECALL_FAILED_TO_SEND_COMMAND;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    slens[i] = (size_t)lens[i];
+  }
+  while (inst->pending_head) {
+    complete_head(inst);
+  }
+  struct share_mem_header *const header = fmo_view(inst->fmo);
+  if (process_issync(inst->value)) {
+    // Replies could fill the pipe while we are still writing, so send the requests one by one.
+    header->batch_size = 1;
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t const start = measure_begin();
+      if (process_write(inst->value, bufs[i], slens[i]) != 0) {
+        tickets[i].err = ECALL_FAILED_TO_SEND_COMMAND;
+        err = ECALL_FAILED_TO_SEND_COMMAND;
+        break;
+      }
+      measure_end(inst, BRIDGE_PHASE_WRITE, start, slens[i]);
+      stats_add(inst->stats, STATS_CALLS, 1);
+      stats_add(inst->stats, STATS_BYTES_IN, slens[i]);
+      tickets[i].sent = measure_begin();
+      push_pending(inst, &tickets[i]);
+      complete_head(inst);
+      if (tickets[i].err != ECALL_OK) {
+        err = tickets[i].err;
+        break;
+      }
+    }
+  } else {
+    header->batch_size = (uint32_t)n;
+    uint64_t const start = measure_begin();
+    if (process_write_batch(inst->value, bufs, slens, n) != 0) {
+      free(slens);
+      free(tickets);
+      return ECALL_FAILED_TO_SEND_COMMAND;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+      total += slens[i];
+    }
+    measure_end(inst, BRIDGE_PHASE_WRITE, start, total);
+    uint64_t const sent = measure_begin();
+    for (size_t i = 0; i < n; ++i) {
+      stats_add(inst->stats, STATS_CALLS, 1);
+      stats_add(inst->stats, STATS_BYTES_IN, slens[i]);
+      tickets[i].sent = sent;
+      push_pending(inst, &tickets[i]);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      complete_head(inst);
+      if (tickets[i].err != ECALL_OK && err == ECALL_OK) {
+        err = tickets[i].err;
+      }
+    }
+  }
+  free(slens);
+  for (size_t i = 0; i < n; ++i) {
+    if (err == ECALL_OK) {
+      r[i] = tickets[i].r;
+      rlen[i] = tickets[i].rlen;
+    } else {
+      process_free_buffer(tickets[i].r);
+    }
+  }
+  free(tickets);
+  return err;
+}
+
+// Finishes the child of inst so that the next call starts it with the current settings.
+// inst->mtx must be held.
+static void instance_restart(struct instance *const inst) {
+  while (inst->pending_head) {
+    complete_head(inst);
+  }
+  if (inst->value) {
+    process_finish(inst->value);
+    inst->value = NULL;
+  }
+}
+
+int bridge_set_pool_size(char const *const exe_path, size_t const n) {
+  if (g_max_width == 0 || g_max_height == 0) {
     return ECALL_NOT_INITIALIZED;
   }
-  const size_t exe_path_len = (size_t)(lstrlenA(exe_path));
-  struct hash_map_value *hmv = hashmap_get(&g_process_map, exe_path, exe_path_len);
-  if (hmv) {
-    if (!process_isrunning(hmv->value)) {
-      // It seems process is already dead
-      process_finish(hmv->value);
-      hashmap_remove(&g_process_map, exe_path, exe_path_len);
-      free(hmv);
-      hmv = NULL;
+  if (n == 0 || n > MAX_POOL_SIZE) {
+    return ECALL_INVALID_POOL_SIZE;
+  }
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = find_or_insert(exe_path);
+  if (!hmv) {
+    mtx_unlock(&g_mutex);
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  if (!pool_fits(n, hmv->channel_size, hmv->doorbell)) {
+    mtx_unlock(&g_mutex);
+    return ECALL_INVALID_POOL_SIZE;
+  }
+  if (!pool_grow(hmv, n)) {
+    mtx_unlock(&g_mutex);
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  size_t const old = hmv->num_instances;
+  hmv->num_instances = n;
+  hmv->next = 0;
+  for (size_t i = n; i < old; ++i) {
+    hmv->instances[i]->retired = true;
+  }
+  mtx_unlock(&g_mutex);
+  // Retired instances are kept allocated because tickets and racing calls may still refer to them.
+  for (size_t i = n; i < old; ++i) {
+    struct instance *const inst = hmv->instances[i];
+    mtx_lock(&inst->mtx);
+    instance_restart(inst);
+    mtx_unlock(&inst->mtx);
+  }
+  return ECALL_OK;
+}
+
+int bridge_set_sync(char const *const exe_path, bool const sync) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = find_or_insert(exe_path);
+  if (!hmv) {
+    mtx_unlock(&g_mutex);
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  hmv->sync = sync;
+  size_t const n = hmv->allocated_instances;
+  struct instance *insts[MAX_POOL_SIZE];
+  memcpy(insts, hmv->instances, n * sizeof(struct instance *));
+  mtx_unlock(&g_mutex);
+  // Running children are restarted in the new mode by the next call.
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    if (inst->sync != sync) {
+      inst->sync = sync;
+      instance_restart(inst);
     }
+    mtx_unlock(&inst->mtx);
   }
+  return ECALL_OK;
+}
+
+int bridge_set_doorbell(char const *const exe_path, bool const doorbell) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = find_or_insert(exe_path);
   if (!hmv) {
-    hmv = malloc(sizeof(struct hash_map_value) + exe_path_len);
-    int buflen = MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, exe_path, (int)exe_path_len, NULL, 0);
-    WCHAR *wpath = malloc(sizeof(WCHAR) * (size_t)(buflen + 1));
-    if (!wpath) {
-      free(hmv);
-      return ECALL_FAILED_TO_CONVERT_EXE_PATH;
-    }
-    if (MultiByteToWideChar(CP_ACP, MB_PRECOMPOSED, exe_path, (int)exe_path_len, wpath, buflen) == 0) {
-      free(hmv);
-      free(wpath);
-      return ECALL_FAILED_TO_CONVERT_EXE_PATH;
-    }
-    wpath[buflen] = '\0';
-    struct process *p = process_start(wpath, L"BRIDGE_FMO", g_mapped_file_name);
-    if (!p) {
-      free(hmv);
-      free(wpath);
-      return ECALL_FAILED_TO_START_PROCESS;
-    }
-    free(wpath);
-    process_close_stderr(p);
-    hmv->value = p;
-    char *key = (char *)(hmv + 1);
-    memcpy(key, exe_path, exe_path_len);
-    if (hashmap_put(&g_process_map, key, exe_path_len, hmv) != 0) {
-      process_finish(p);
-      free(hmv);
-      return ECALL_FAILED_TO_START_PROCESS;
+    mtx_unlock(&g_mutex);
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  if (!pool_fits(hmv->num_instances, hmv->channel_size, doorbell)) {
+    mtx_unlock(&g_mutex);
+    return ECALL_INVALID_POOL_SIZE;
+  }
+  hmv->doorbell = doorbell;
+  size_t const n = hmv->allocated_instances;
+  struct instance *insts[MAX_POOL_SIZE];
+  memcpy(insts, hmv->instances, n * sizeof(struct instance *));
+  mtx_unlock(&g_mutex);
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    if (inst->doorbell != doorbell) {
+      inst->doorbell = doorbell;
+      instance_restart(inst);
     }
+    mtx_unlock(&inst->mtx);
   }
-  if (mem) {
-    struct share_mem_header *v = g_view;
-    v->width = (uint32_t)mem->width;
-    v->height = (uint32_t)mem->height;
-    if (mem->mode & MEM_MODE_READ) {
-      memcpy(v + 1, mem->buf, (size_t)(mem->width * 4 * mem->height));
+  return ECALL_OK;
+}
+
+int bridge_set_wait_policy(char const *const exe_path, enum wait_policy const policy, uint32_t const spins) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = find_or_insert(exe_path);
+  if (!hmv) {
+    mtx_unlock(&g_mutex);
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  hmv->wait_policy = policy;
+  hmv->wait_spins = spins;
+  size_t const n = hmv->allocated_instances;
+  struct instance *insts[MAX_POOL_SIZE];
+  memcpy(insts, hmv->instances, n * sizeof(struct instance *));
+  mtx_unlock(&g_mutex);
+  // Unlike the other settings, running children do not have to be restarted.
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    inst->wait_policy = policy;
+    inst->wait_spins = spins;
+    if (inst->value) {
+      process_set_wait_policy(inst->value, policy, spins);
     }
+    mtx_unlock(&inst->mtx);
   }
-  if (process_write(hmv->value, buf, (size_t)len) != 0) {
-    return ECALL_FAILED_TO_SEND_COMMAND;
+  return ECALL_OK;
+}
+
+int bridge_set_channel_size(char const *const exe_path, size_t const size) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
   }
-  void *rbuf;
-  size_t rbuflen;
-  if (process_read(hmv->value, &rbuf, &rbuflen) != 0) {
-    return ECALL_FAILED_TO_RECEIVE_COMMAND;
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = find_or_insert(exe_path);
+  if (!hmv) {
+    mtx_unlock(&g_mutex);
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  if (!pool_fits(hmv->num_instances, size, hmv->doorbell)) {
+    mtx_unlock(&g_mutex);
+    return ECALL_INVALID_POOL_SIZE;
   }
-  if (mem && mem->mode & MEM_MODE_WRITE) {
-    struct share_mem_header *v = g_view;
-    memcpy(mem->buf, v + 1, (size_t)(mem->width * 4 * mem->height));
+  hmv->channel_size = size;
+  size_t const n = hmv->allocated_instances;
+  struct instance *insts[MAX_POOL_SIZE];
+  memcpy(insts, hmv->instances, n * sizeof(struct instance *));
+  mtx_unlock(&g_mutex);
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    if (inst->channel_size != size) {
+      inst->channel_size = size;
+      instance_restart(inst);
+    }
+    mtx_unlock(&inst->mtx);
   }
-  *r = rbuf;
-  *rlen = (int32_t)rbuflen;
   return ECALL_OK;
 }
 
-int bridge_call(const char *exe_path, const void *buf, int32_t len, struct call_mem *mem, void **r, int32_t *rlen) {
+// Copies the active instances of exe_path into insts, which must have room for MAX_POOL_SIZE items.
+// Unless insert is set, an exe_path that has never been used yields no instances instead of being registered.
+static size_t get_instances(char const *const exe_path, struct instance **const insts, bool const insert) {
   mtx_lock(&g_mutex);
-  int ret = bridge_call_core(exe_path, buf, len, mem, r, rlen);
+  struct hash_map_value *const hmv =
+      insert ? find_or_insert(exe_path) : hashmap_get(&g_process_map, exe_path, strlen(exe_path));
+  size_t n = 0;
+  if (hmv) {
+    n = hmv->num_instances;
+    memcpy(insts, hmv->instances, n * sizeof(struct instance *));
+  }
   mtx_unlock(&g_mutex);
+  return n;
+}
+
+int bridge_preload(char const *const exe_path, void const *const buf, int32_t const len) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  struct instance *insts[MAX_POOL_SIZE];
+  size_t const n = get_instances(exe_path, insts, true);
+  if (n == 0) {
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  int ret = ECALL_OK;
+  for (size_t i = 0; i < n && ret == ECALL_OK; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    if (inst->retired) {
+      mtx_unlock(&inst->mtx);
+      continue;
+    }
+    ret = prepare_process(inst, exe_path);
+    if (ret == ECALL_OK && buf) {
+      struct bridge_ticket *t = NULL;
+      ret = bridge_call_core(inst, exe_path, buf, len, NULL, 0, NULL, NULL, &t);
+      if (ret == ECALL_OK) {
+        t->warmup = true;
+        t->abandoned = true;
+        ++inst->warmups_pending;
+      }
+    }
+    mtx_unlock(&inst->mtx);
+  }
+  return ret;
+}
+
+int bridge_ready(char const *const exe_path) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  // An exe_path that has never been used has no warm-up requests to wait for.
+  struct instance *insts[MAX_POOL_SIZE];
+  size_t const n = get_instances(exe_path, insts, false);
+  int ret = ECALL_OK;
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    while (inst->warmups_pending > 0) {
+      complete_head(inst);
+    }
+    if (inst->warmup_err != ECALL_OK && ret == ECALL_OK) {
+      ret = inst->warmup_err;
+    }
+    inst->warmup_err = ECALL_OK;
+    mtx_unlock(&inst->mtx);
+  }
   return ret;
 }
+
+int bridge_get_buffer_stats(char const *const exe_path, struct bridge_buffer_stats *const stats) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  struct instance *insts[MAX_POOL_SIZE];
+  size_t const n = get_instances(exe_path, insts, false);
+  stats->pooled = 0;
+  stats->in_use = 0;
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    if (inst->value) {
+      struct process_buffer_stats ps;
+      process_get_buffer_stats(inst->value, &ps);
+      stats->pooled += ps.pooled;
+      stats->in_use += ps.in_use;
+    }
+    mtx_unlock(&inst->mtx);
+  }
+  return ECALL_OK;
+}
+
+int bridge_get_wait_stats(char const *const exe_path, struct bridge_wait_stats *const stats) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  struct instance *insts[MAX_POOL_SIZE];
+  size_t const n = get_instances(exe_path, insts, false);
+  stats->spin_succeeded = 0;
+  stats->blocked = 0;
+  for (size_t i = 0; i < n; ++i) {
+    struct instance *const inst = insts[i];
+    mtx_lock(&inst->mtx);
+    if (inst->value) {
+      struct process_wait_stats ws;
+      process_get_wait_stats(inst->value, &ws);
+      stats->spin_succeeded += ws.spin_succeeded;
+      stats->blocked += ws.blocked;
+    }
+    mtx_unlock(&inst->mtx);
+  }
+  return ECALL_OK;
+}
+
+int bridge_call_async(char const *const exe_path,
+                      void const *const buf,
+                      int32_t const len,
+                      struct call_mem *const mem,
+                      int32_t const flags,
+                      struct bridge_ticket **const ticket) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  // The pixels may be hashed below, before bridge_call_core checks the size against the shared memory.
+  if (mem && (mem->width <= 0 || mem->height <= 0)) {
+    return ECALL_IMAGE_TOO_LARGE;
+  }
+  // Covers the cache lookup and picking an instance.
+  uint64_t const start = measure_begin();
+  struct cache_pending *cache = NULL;
+  uint64_t pixel_hash = 0;
+  bool has_pixel_hash = false;
+  if (flags & CALL_FLAG_CACHE && cache_enabled()) {
+    struct cache_key key = {
+        .exe_path = exe_path,
+        .exe_path_len = strlen(exe_path),
+        .buf = buf,
+        .len = (size_t)len,
+    };
+    if (mem) {
+      key.mode = mem->mode;
+      key.format = mem->format;
+      key.width = mem->width;
+      key.height = mem->height;
+      if (mem->mode & MEM_MODE_READ) {
+        // The same value calc_hash returns with its legacy flag, so it can be compared with content_hash.
+        key.pixel_hash = cyrb64(mem->buf, (size_t)mem->width * (size_t)mem->height, PIXEL_HASH_SEED);
+        pixel_hash = key.pixel_hash;
+        has_pixel_hash = true;
+      }
+    }
+    struct bridge_ticket *const t = calloc(1, sizeof(struct bridge_ticket));
+    if (!t) {
+      return ECALL_FAILED_TO_SEND_COMMAND;
+    }
+    void *r = NULL;
+    size_t rlen = 0;
+    if (cache_lookup(&key, &r, &rlen, mem && mem->mode & MEM_MODE_WRITE ? mem->buf : NULL)) {
+      t->done = true;
+      t->err = ECALL_OK;
+      t->r = r;
+      t->rlen = (int32_t)rlen;
+      *ticket = t;
+      struct hash_map_value *const hmv = start && trace_enabled() ? find_existing(exe_path) : NULL;
+      if (hmv) {
+        trace_record("cache_hit", (char const *)(hmv + 1), hmv->exe_path_len, start, timer_now_ns(), rlen);
+      }
+      return ECALL_OK;
+    }
+    free(t);
+    cache = cache_pending_create(&key);
+  }
+  struct instance *const inst = acquire_instance(exe_path);
+  if (!inst) {
+    if (cache) {
+      cache_pending_destroy(cache);
+    }
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  measure_trace(inst, "lookup", start, 0);
+  int ret = bridge_call_core(inst, exe_path, buf, len, mem, flags, has_pixel_hash ? &pixel_hash : NULL, cache, ticket);
+  mtx_unlock(&inst->mtx);
+  if (ret != ECALL_OK && cache) {
+    cache_pending_destroy(cache);
+  }
+  return ret;
+}
+
+int bridge_call_batch(char const *const exe_path,
+                      void const *const *const bufs,
+                      int32_t const *const lens,
+                      size_t const n,
+                      void **const r,
+                      int32_t *const rlen) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  if (n == 0) {
+    return ECALL_OK;
+  }
+  struct instance *const inst = acquire_instance(exe_path);
+  if (!inst) {
+    return ECALL_FAILED_TO_START_PROCESS;
+  }
+  int ret = bridge_call_batch_core(inst, exe_path, bufs, lens, n, r, rlen);
+  mtx_unlock(&inst->mtx);
+  return ret;
+}
+
+int bridge_wait(struct bridge_ticket *const ticket, void **const r, int32_t *const rlen, bool *const unchanged) {
+  struct instance *const inst = ticket->inst;
+  if (inst) {
+    mtx_lock(&inst->mtx);
+    while (!ticket->done) {
+      complete_head(inst);
+    }
+    mtx_unlock(&inst->mtx);
+  }
+  int const err = ticket->err;
+  if (err == ECALL_OK) {
+    *r = ticket->r;
+    *rlen = ticket->rlen;
+    if (unchanged) {
+      *unchanged = ticket->unchanged;
+    }
+  }
+  free(ticket);
+  return err;
+}
+
+bool bridge_poll(struct bridge_ticket *const ticket) {
+  struct instance *const inst = ticket->inst;
+  if (!inst) {
+    return true;
+  }
+  mtx_lock(&inst->mtx);
+  while (!ticket->done && process_readable(inst->value)) {
+    complete_head(inst);
+  }
+  bool const done = ticket->done;
+  mtx_unlock(&inst->mtx);
+  return done;
+}
+
+void bridge_cancel(struct bridge_ticket *const ticket) {
+  struct instance *const inst = ticket->inst;
+  if (inst) {
+    mtx_lock(&inst->mtx);
+  }
+  if (ticket->done) {
+    process_free_buffer(ticket->r);
+    free(ticket);
+  } else {
+    // The reply still has to be read to keep the stream in sync, complete_head frees it.
+    ticket->abandoned = true;
+  }
+  if (inst) {
+    mtx_unlock(&inst->mtx);
+  }
+}
+
+int bridge_call(char const *const exe_path,
+                void const *const buf,
+                int32_t const len,
+                struct call_mem *const mem,
+                int32_t const flags,
+                void **const r,
+                int32_t *const rlen) {
+  struct bridge_ticket *t = NULL;
+  int const err = bridge_call_async(exe_path, buf, len, mem, flags, &t);
+  if (err != ECALL_OK) {
+    return err;
+  }
+  return bridge_wait(t, r, rlen, mem ? &mem->unchanged : NULL);
+}
+
+void bridge_free_reply(void *const r) { process_free_buffer(r); }
+
+void bridge_set_cache_budget(size_t const budget) {
+  // The cache and its mutex only exist between bridge_init and bridge_exit.
+  if (g_max_width == 0 || g_max_height == 0) {
+    return;
+  }
+  cache_set_budget(budget);
+}
+
+void bridge_get_cache_stats(struct bridge_cache_stats *const stats) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  struct cache_stats cs;
+  cache_get_stats(&cs);
+  stats->hits = cs.hits;
+  stats->misses = cs.misses;
+  stats->entries = cs.entries;
+  stats->bytes = cs.bytes;
+  stats->budget = cs.budget;
+}
+
+void bridge_set_stats_enabled(bool const enabled) { stats_set_enabled(enabled); }
+
+int bridge_get_stats(char const *const exe_path, struct bridge_stats *const stats) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return ECALL_NOT_INITIALIZED;
+  }
+  mtx_lock(&g_mutex);
+  struct hash_map_value *const hmv = hashmap_get(&g_process_map, exe_path, strlen(exe_path));
+  if (hmv) {
+    stats_get(hmv->stats, stats);
+  } else {
+    // Querying does not register exe_path, it just has nothing recorded yet.
+    memset(stats, 0, sizeof(*stats));
+  }
+  mtx_unlock(&g_mutex);
+  int err = bridge_get_buffer_stats(exe_path, &stats->buffers);
+  if (err == ECALL_OK) {
+    err = bridge_get_wait_stats(exe_path, &stats->waits);
+  }
+  return err;
+}
+
+struct exe_path_list {
+  char **paths;
+  size_t *lens;
+  size_t n;
+};
+
+static int collect_exe_path_callback(void *const context, void *const value) {
+  struct exe_path_list *const list = context;
+  struct hash_map_value const *const hmv = value;
+  char *const path = malloc(hmv->exe_path_len + 1);
+  if (!path) {
+    return 0;
+  }
+  memcpy(path, hmv + 1, hmv->exe_path_len);
+  path[hmv->exe_path_len] = '\0';
+  list->paths[list->n] = path;
+  list->lens[list->n] = hmv->exe_path_len;
+  ++list->n;
+  return 1;
+}
+
+void bridge_foreach_stats(bool (*const f)(void *const userdata,
+                                          char const *const exe_path,
+                                          size_t const exe_path_len,
+                                          struct bridge_stats const *const stats),
+                          void *const userdata) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return;
+  }
+  // Copy the paths because bridge_get_stats cannot be called while g_mutex is held.
+  mtx_lock(&g_mutex);
+  size_t const n = hashmap_num_entries(&g_process_map);
+  struct exe_path_list list = {
+      .paths = malloc(n * sizeof(char *)),
+      .lens = malloc(n * sizeof(size_t)),
+  };
+  if (list.paths && list.lens) {
+    hashmap_iterate(&g_process_map, collect_exe_path_callback, &list);
+  }
+  mtx_unlock(&g_mutex);
+  bool cont = true;
+  for (size_t i = 0; i < list.n; ++i) {
+    struct bridge_stats stats;
+    if (cont && bridge_get_stats(list.paths[i], &stats) == ECALL_OK) {
+      cont = f(userdata, list.paths[i], list.lens[i], &stats);
+    }
+    free(list.paths[i]);
+  }
+  free(list.lens);
+  free(list.paths);
+}
+
+static int reset_stats_callback(void *const context, void *const value) {
+  (void)context;
+  struct hash_map_value *const hmv = value;
+  stats_reset(hmv->stats);
+  return 1;
+}
+
+void bridge_reset_stats(void) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return;
+  }
+  mtx_lock(&g_mutex);
+  hashmap_iterate(&g_process_map, reset_stats_callback, NULL);
+  mtx_unlock(&g_mutex);
+}
+
+uint64_t bridge_stats_begin(void) { return measure_begin(); }
+
+void bridge_stats_end(char const *const exe_path, enum bridge_phase const phase, uint64_t const start) {
+  if (!start || !exe_path || (unsigned)phase >= BRIDGE_PHASE_COUNT || g_max_width == 0 || g_max_height == 0) {
+    return;
+  }
+  uint64_t const end = timer_now_ns();
+  struct hash_map_value *const hmv = find_existing(exe_path);
+  if (hmv) {
+    stats_record(hmv->stats, phase, end > start ? end - start : 0);
+    trace_record(bridge_phase_name(phase), (char const *)(hmv + 1), hmv->exe_path_len, start, end, 0);
+  }
+}
+
+char const *bridge_phase_name(enum bridge_phase const phase) {
+  static char const *const names[BRIDGE_PHASE_COUNT] = {
+      "spawn",
+      "upload",
+      "write",
+      "wait",
+      "write_back",
+      "putpixeldata",
+      "lua_push",
+  };
+  // The value may come from a host.
+  if ((unsigned)phase >= BRIDGE_PHASE_COUNT) {
+    return NULL;
+  }
+  return names[phase];
+}
+
+bool bridge_trace_start(char const *const path) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return false;
+  }
+  return trace_start(path);
+}
+
+bool bridge_trace_stop(void) {
+  if (g_max_width == 0 || g_max_height == 0) {
+    return false;
+  }
+  return trace_stop();
+}
@@ -1,14 +1,99 @@
 #pragma once
 
+// The C API of the bridge engine, built as the static library "bridge".
+// The Lua module is a thin layer over it, native hosts can link the library and include this header alone.
+//
+// A host calls bridge_init once, then bridge_call and friends from any thread, then bridge_exit.
+// Every function that takes an exe_path returns one of ECALL, the others document their result.
+// share_mem_header and the constants next to it describe what the child sees, not the host.
+
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// Incremented when a declaration in this header changes incompatibly.
+// Additions such as new fields at the end of share_mem_header, new enumerators or new functions do not change it.
+#define BRIDGE_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct share_mem_header {
   uint32_t header_size;
   uint32_t body_size;
   uint32_t version;
   uint32_t width;
   uint32_t height;
+  // version 2 or later
+  // Number of requests sent together with the current one, counting itself.
+  uint32_t batch_size;
+  // version 3 or later
+  // Non-zero if only the tiles marked in the dirty tile bitmap were uploaded, see CALL_FLAG_DELTA.
+  // Tiles are tile_size x tile_size pixels, the ones on the right and bottom edges may be smaller.
+  uint32_t tile_size;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  // Offset of the dirty tile bitmap from the beginning of the header.
+  // Bit (i % 8) of byte (i / 8) is set if tile i = y * tiles_x + x differs from the previous request.
+  uint32_t dirty_offset;
+  // version 4 or later
+  // Offset of an array of max_dirty_rects share_mem_rect from the beginning of the header.
+  uint32_t dirty_rects_offset;
+  uint32_t max_dirty_rects;
+  // Written by the child before replying to tell which pixels it modified.
+  // 0 means nothing was modified, SHARE_MEM_DIRTY_RECTS_ALL or any value above max_dirty_rects means everything.
+  // It is reset to SHARE_MEM_DIRTY_RECTS_ALL before each request.
+  uint32_t num_dirty_rects;
+  // version 5 or later
+  // Layout of the pixels, one of pixel_format.
+  uint32_t format;
+  // version 6 or later
+  // Ring areas used instead of the pipes for large payloads, the sizes are 0 if it is disabled.
+  // A frame whose length is SHARE_MEM_CHANNEL_FRAME is followed by uint32_t offset and uint32_t size
+  // that point to the payload in the request area or the reply area.
+  uint32_t request_area_offset;
+  uint32_t request_area_size;
+  uint32_t reply_area_offset;
+  uint32_t reply_area_size;
+  // Number of bytes of the reply area the bridge has consumed, including skipped ones.
+  uint32_t reply_read;
+  // version 7 or later
+  // Non-zero if requests and replies are announced by the fields below instead of the pipes, see doorbell.h.
+  // Every payload then goes through the ring areas.
+  uint32_t doorbell;
+  // Incremented by the bridge after it has placed a request at request_offset.
+  uint32_t request_seq;
+  uint32_t request_offset;
+  uint32_t request_size;
+  // Non-zero while the child is sleeping on request_seq.
+  uint32_t request_waiting;
+  // Set to request_seq by the child after it has placed the reply at reply_offset.
+  uint32_t reply_seq;
+  uint32_t reply_offset;
+  uint32_t reply_size;
+  // Non-zero while the bridge is sleeping on reply_seq.
+  uint32_t reply_waiting;
+  // version 8 or later
+  // Incremented by the bridge when it writes pixels that differ from the ones it wrote before, 0 until then.
+  // Identical pixels sent again keep the generation even if they had to be copied again,
+  // so a child that sees the generation it has already processed can reuse its output.
+  uint32_t generation;
+  // Non-zero if content_hash is set, it is only known for requests with CALL_FLAG_CACHE while the cache is enabled.
+  uint32_t has_content_hash;
+  // Hash of the pixels of the request as PIXEL_FORMAT_BGRA, only comparable with other values of this field.
+  uint64_t content_hash;
+};
+
+#define SHARE_MEM_CHANNEL_FRAME (-1)
+
+#define SHARE_MEM_DIRTY_RECTS_ALL UINT32_C(0xffffffff)
+
+struct share_mem_rect {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
 };
 
 enum ECALL {
@@ -18,26 +103,235 @@ enum ECALL {
   ECALL_FAILED_TO_START_PROCESS,
   ECALL_FAILED_TO_SEND_COMMAND,
   ECALL_FAILED_TO_RECEIVE_COMMAND,
+  ECALL_IMAGE_TOO_LARGE,
+  ECALL_INVALID_POOL_SIZE,
 };
 
 enum mem_mode {
+  // The child receives the pixels.
   MEM_MODE_READ = 1,
+  // The pixels the child leaves in the shared memory are copied back.
   MEM_MODE_WRITE = 2,
+  // Used by the Lua module for a buffer given by the script instead of obj.getpixeldata, the engine ignores it.
   MEM_MODE_DIRECT = 4,
 };
 
+enum call_flag {
+  // Reuse the reply of an identical earlier request instead of asking the child.
+  // Only use this with children whose reply depends on nothing but the request and the pixels.
+  // The hash of the pixels also lets the upload be skipped if the child still has them, see share_mem_header.generation.
+  CALL_FLAG_CACHE = 1,
+  // Upload only the tiles of MEM_MODE_READ pixels that changed since the last upload to the same child.
+  // Only use this with children that do not modify the pixels, it has no effect with MEM_MODE_WRITE.
+  CALL_FLAG_DELTA = 2,
+};
+
+enum pixel_format {
+  // B, G, R, A bytes per pixel with straight alpha, the format of obj.getpixeldata.
+  PIXEL_FORMAT_BGRA = 0,
+  // Same as PIXEL_FORMAT_BGRA but B, G and R are multiplied by alpha.
+  PIXEL_FORMAT_PREMULTIPLIED = 1,
+  // Four width x height planes of B, G, R and A bytes with straight alpha.
+  PIXEL_FORMAT_PLANAR = 2,
+  // B, G, R, A floats from 0 to 1 per pixel with straight alpha, four times larger than the others.
+  PIXEL_FORMAT_FLOAT = 3,
+};
+
+enum wait_policy {
+  // Polls for as long as recent replies of the same child took, unless they were slow.
+  WAIT_POLICY_ADAPTIVE = 0,
+  // Sleeps right away.
+  WAIT_POLICY_BLOCK = 1,
+  // Polls the given number of times before sleeping.
+  WAIT_POLICY_SPIN = 2,
+};
+
+#define BRIDGE_DEFAULT_SPINS 4000
+
+struct bridge_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+  uint32_t padding;
+};
+
+struct bridge_buffer_stats {
+  // Bytes of reply buffers kept for reuse.
+  size_t pooled;
+  // Bytes of replies that have been received but not released yet.
+  size_t in_use;
+};
+
+struct bridge_wait_stats {
+  // Replies that arrived while polling.
+  uint64_t spin_succeeded;
+  // Waits that had to sleep.
+  uint64_t blocked;
+};
+
+enum bridge_phase {
+  // Starting a child, including the shared memory.
+  BRIDGE_PHASE_SPAWN,
+  // Copying or converting the pixels into the shared memory.
+  BRIDGE_PHASE_UPLOAD,
+  // Sending the request.
+  BRIDGE_PHASE_WRITE,
+  // From the request being sent to the reply being received, mostly the work of the child.
+  BRIDGE_PHASE_WAIT,
+  // Copying the pixels the child modified back.
+  BRIDGE_PHASE_WRITE_BACK,
+  // obj.putpixeldata, measured by the Lua module.
+  BRIDGE_PHASE_PUTPIXELDATA,
+  // Pushing the reply onto the Lua stack, measured by the Lua module.
+  BRIDGE_PHASE_LUA_PUSH,
+  BRIDGE_PHASE_COUNT,
+};
+
+struct bridge_latency {
+  uint64_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t mean_ns;
+  // Percentiles are accurate to about 12%.
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+};
+
+struct bridge_stats {
+  // Requests sent to children, cache hits are not included.
+  uint64_t calls;
+  // Request payloads and uploaded pixels.
+  uint64_t bytes_in;
+  // Replies and written back pixels.
+  uint64_t bytes_out;
+  uint64_t spawns;
+  // Spawns of an instance whose previous child has exited or was restarted.
+  uint64_t respawns;
+  struct bridge_latency phases[BRIDGE_PHASE_COUNT];
+  struct bridge_buffer_stats buffers;
+  struct bridge_wait_stats waits;
+};
+
+struct bridge_ticket;
+
+// A pixel buffer passed along with a request, NULL means the request has no pixels.
 struct call_mem {
+  // width x height pixels of PIXEL_FORMAT_BGRA, rows are not padded.
   void *buf;
+  // A combination of mem_mode.
   int32_t mode;
   int32_t width;
   int32_t height;
+  // The layout the child sees, mem->buf is always PIXEL_FORMAT_BGRA.
+  enum pixel_format format;
+  // Set by bridge_call if the child reported that it did not modify the pixels.
+  bool unchanged;
+  uint8_t padding[3];
 };
 
+// Sets up the engine for pixel buffers up to max_width x max_height, larger ones fail with ECALL_IMAGE_TOO_LARGE.
+// Every other function fails with ECALL_NOT_INITIALIZED or does nothing until it has succeeded.
 bool bridge_init(int32_t const max_width, int32_t const max_height);
+// bridge_call is thread-safe. Calls to different executables run in parallel.
+// On success, *r must be released by bridge_free_reply.
 int bridge_call(char const *const exe_path,
                 void const *const buf,
                 int32_t const len,
                 struct call_mem *const mem,
+                int32_t const flags,
                 void **const r,
                 int32_t *const rlen);
+// Keeps up to n instances of exe_path and dispatches calls to an idle one.
+// Instances are started on demand, each with its own shared memory.
+// On 32-bit hosts it fails with ECALL_INVALID_POOL_SIZE if the shared memory of the pool would not fit
+// in the address space, as do bridge_set_channel_size and bridge_set_doorbell when they grow it.
+int bridge_set_pool_size(char const *const exe_path, size_t const n);
+// Reserves size bytes of shared memory per instance of exe_path to pass large payloads.
+// The child has to understand SHARE_MEM_CHANNEL_FRAME, 0 disables it.
+int bridge_set_channel_size(char const *const exe_path, size_t const size);
+// Reads the replies of exe_path on the calling thread instead of a dedicated reader thread.
+// It saves a thread switch per call, but requests to the same instance are no longer pipelined.
+int bridge_set_sync(char const *const exe_path, bool const sync);
+// Wakes the child through the shared memory instead of the pipes, which has a much lower latency.
+// The child has to understand share_mem_header.doorbell. Requests are no longer pipelined
+// and payloads larger than the channel fail, a 1MiB channel is reserved if none was set.
+int bridge_set_doorbell(char const *const exe_path, bool const doorbell);
+// Sets how the calling thread waits for the replies of exe_path, spins is used by WAIT_POLICY_SPIN.
+// It has no effect on synchronous children without the doorbell, which always sleep in the pipe.
+int bridge_set_wait_policy(char const *const exe_path, enum wait_policy const policy, uint32_t const spins);
+// Starts every instance of exe_path that is not running yet without waiting for it.
+// If buf is not NULL, it is sent to each instance as a warm-up request and the reply is discarded.
+int bridge_preload(char const *const exe_path, void const *const buf, int32_t const len);
+// Blocks until every warm-up request sent by bridge_preload has been answered.
+int bridge_ready(char const *const exe_path);
+// Sends n requests with a single write and waits for all replies.
+// On success, every r[i] must be released by bridge_free_reply.
+int bridge_call_batch(char const *const exe_path,
+                      void const *const *const bufs,
+                      int32_t const *const lens,
+                      size_t const n,
+                      void **const r,
+                      int32_t *const rlen);
+// Sends a request without waiting for the reply.
+// Requests to the same executable are answered in the order they were sent.
+// For MEM_MODE_WRITE, mem->buf is written when the ticket completes, so it must stay valid until then.
+// On success, *ticket must be passed to either bridge_wait or bridge_cancel.
+int bridge_call_async(char const *const exe_path,
+                      void const *const buf,
+                      int32_t const len,
+                      struct call_mem *const mem,
+                      int32_t const flags,
+                      struct bridge_ticket **const ticket);
+// Blocks until the reply arrives and frees ticket.
+// On success, *r must be released by bridge_free_reply.
+// If unchanged is not NULL, it receives whether the child reported that it did not modify the pixels.
+int bridge_wait(struct bridge_ticket *const ticket, void **const r, int32_t *const rlen, bool *const unchanged);
+// Returns true if bridge_wait will not block.
+bool bridge_poll(struct bridge_ticket *const ticket);
+// Discards the reply and frees ticket.
+void bridge_cancel(struct bridge_ticket *const ticket);
+// Releases a reply, r may be NULL.
+void bridge_free_reply(void *const r);
+// Sets the memory budget of the reply cache used by CALL_FLAG_CACHE in bytes. 0 disables it.
+void bridge_set_cache_budget(size_t const budget);
+// Reports all zeros before bridge_init.
+void bridge_get_cache_stats(struct bridge_cache_stats *const stats);
+// Sums up the reply buffers of the running instances of exe_path.
+int bridge_get_buffer_stats(char const *const exe_path, struct bridge_buffer_stats *const stats);
+// Sums up how the waits for the running instances of exe_path ended.
+int bridge_get_wait_stats(char const *const exe_path, struct bridge_wait_stats *const stats);
+// Statistics are collected only while enabled, it is disabled by default.
+void bridge_set_stats_enabled(bool const enabled);
+// Reports zeros for an exe_path that has never been used without registering it, as do the two above.
+int bridge_get_stats(char const *const exe_path, struct bridge_stats *const stats);
+// Calls f for every executable that has been used, stops if f returns false.
+void bridge_foreach_stats(bool (*const f)(void *const userdata,
+                                          char const *const exe_path,
+                                          size_t const exe_path_len,
+                                          struct bridge_stats const *const stats),
+                          void *const userdata);
+// Clears the counters and the histograms of every executable.
+void bridge_reset_stats(void);
+// For phases measured outside, returns 0 if neither statistics nor tracing are enabled.
+uint64_t bridge_stats_begin(void);
+// Records the time since start in phase of exe_path, unknown phases are ignored.
+void bridge_stats_end(char const *const exe_path, enum bridge_phase const phase, uint64_t const start);
+// Returns a short lower case name such as "write_back", or NULL if phase is not a bridge_phase.
+char const *bridge_phase_name(enum bridge_phase const phase);
+// Records every phase of every call until bridge_trace_stop writes them to path
+// in the Chrome trace event format, which chrome://tracing and Perfetto can open.
+// Setting the environment variable BRIDGE_TRACE to a path starts it from bridge_init.
+// Returns false if the bridge is not initialized.
+bool bridge_trace_start(char const *const path);
+// Returns false if the bridge is not initialized, tracing was not started or the file could not be written.
+bool bridge_trace_stop(void);
+// Stops every child and releases everything, no other call may be running or pending.
 bool bridge_exit(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,256 @@
+#include "cache.h"
+
+#include <stdatomic.h>
+
+#include "hash.h"
+#include "hashmap.h"
+#include "threads.h"
+
+#include "process.h"
+
+struct cache_entry {
+  // Also used as the key of g_cache_map.
+  uint64_t digest;
+  uint64_t pixel_hash;
+  struct cache_entry *prev;
+  struct cache_entry *next;
+  size_t size;
+  size_t exe_path_len;
+  size_t len;
+  size_t rlen;
+  size_t pixels_len;
+  int32_t mode;
+  int32_t format;
+  int32_t width;
+  int32_t height;
+  uint32_t padding;
+  // followed by exe_path, buf, reply and pixels
+};
+
+struct cache_pending {
+  uint64_t digest;
+  struct cache_key key;
+  // followed by exe_path and buf
+};
+
+static mtx_t g_cache_mutex = {0};
+static struct hashmap_s g_cache_map = {0};
+// Most recently used first.
+static struct cache_entry *g_head = NULL;
+static struct cache_entry *g_tail = NULL;
+// Written under g_cache_mutex, also read by cache_enabled without it.
+static atomic_size_t g_budget = 0;
+static size_t g_bytes = 0;
+static uint64_t g_hits = 0;
+static uint64_t g_misses = 0;
+
+static uint64_t calc_digest(struct cache_key const *const key) {
+  uint64_t const h1 = cyrb64_bytes(key->exe_path, key->exe_path_len, 0);
+  uint64_t const h2 = cyrb64_bytes(key->buf, key->len, (uint32_t)h1);
+  uint32_t const extra[] = {
+      (uint32_t)key->pixel_hash,
+      (uint32_t)(key->pixel_hash >> 32),
+      (uint32_t)key->mode,
+      (uint32_t)key->format,
+      (uint32_t)key->width,
+      (uint32_t)key->height,
+  };
+  return h2 ^ cyrb64(extra, sizeof(extra) / sizeof(extra[0]), (uint32_t)(h1 >> 32));
+}
+
+static bool entry_match(struct cache_entry const *const e, struct cache_key const *const key) {
+  if (e->exe_path_len != key->exe_path_len || e->len != key->len || e->pixel_hash != key->pixel_hash ||
+      e->mode != key->mode || e->format != key->format || e->width != key->width || e->height != key->height) {
+    return false;
+  }
+  char const *const p = (char const *)(e + 1);
+  return memcmp(p, key->exe_path, key->exe_path_len) == 0 && memcmp(p + e->exe_path_len, key->buf, key->len) == 0;
+}
+
+static void unlink_entry(struct cache_entry *const e) {
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    g_head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    g_tail = e->prev;
+  }
+  e->prev = NULL;
+  e->next = NULL;
+}
+
+static void push_front(struct cache_entry *const e) {
+  e->prev = NULL;
+  e->next = g_head;
+  if (g_head) {
+    g_head->prev = e;
+  } else {
+    g_tail = e;
+  }
+  g_head = e;
+}
+
+// g_cache_mutex must be held.
+static void remove_entry(struct cache_entry *const e) {
+  hashmap_remove(&g_cache_map, (char const *)&e->digest, sizeof(e->digest));
+  unlink_entry(e);
+  g_bytes -= e->size;
+  free(e);
+}
+
+// g_cache_mutex must be held.
+static void evict(size_t const budget) {
+  while (g_tail && g_bytes > budget) {
+    remove_entry(g_tail);
+  }
+}
+
+bool cache_init(size_t const budget) {
+  if (hashmap_create(16, &g_cache_map) != 0) {
+    return false;
+  }
+  if (mtx_init(&g_cache_mutex, mtx_plain) != thrd_success) {
+    hashmap_destroy(&g_cache_map);
+    return false;
+  }
+  atomic_store_explicit(&g_budget, budget, memory_order_relaxed);
+  return true;
+}
+
+void cache_exit(void) {
+  mtx_lock(&g_cache_mutex);
+  evict(0);
+  hashmap_destroy(&g_cache_map);
+  atomic_store_explicit(&g_budget, 0, memory_order_relaxed);
+  g_hits = 0;
+  g_misses = 0;
+  mtx_unlock(&g_cache_mutex);
+  mtx_destroy(&g_cache_mutex);
+}
+
+void cache_set_budget(size_t const budget) {
+  mtx_lock(&g_cache_mutex);
+  atomic_store_explicit(&g_budget, budget, memory_order_relaxed);
+  evict(budget);
+  mtx_unlock(&g_cache_mutex);
+}
+
+bool cache_enabled(void) { return atomic_load_explicit(&g_budget, memory_order_relaxed) > 0; }
+
+void cache_get_stats(struct cache_stats *const stats) {
+  mtx_lock(&g_cache_mutex);
+  stats->hits = g_hits;
+  stats->misses = g_misses;
+  stats->entries = hashmap_num_entries(&g_cache_map);
+  stats->bytes = g_bytes;
+  stats->budget = atomic_load_explicit(&g_budget, memory_order_relaxed);
+  mtx_unlock(&g_cache_mutex);
+}
+
+bool cache_lookup(struct cache_key const *const key, void **const r, size_t *const rlen, void *const pixels) {
+  uint64_t const digest = calc_digest(key);
+  mtx_lock(&g_cache_mutex);
+  struct cache_entry *const e = hashmap_get(&g_cache_map, (char const *)&digest, sizeof(digest));
+  if (!e || !entry_match(e, key) || (pixels && e->pixels_len == 0)) {
+    ++g_misses;
+    mtx_unlock(&g_cache_mutex);
+    return false;
+  }
+  void *const rbuf = process_alloc_buffer(e->rlen);
+  if (!rbuf) {
+    ++g_misses;
+    mtx_unlock(&g_cache_mutex);
+    return false;
+  }
+  char const *const reply = (char const *)(e + 1) + e->exe_path_len + e->len;
+  memcpy(rbuf, reply, e->rlen);
+  if (pixels) {
+    memcpy(pixels, reply + e->rlen, e->pixels_len);
+  }
+  // e may be evicted by another thread as soon as the mutex is released.
+  size_t const len = e->rlen;
+  unlink_entry(e);
+  push_front(e);
+  ++g_hits;
+  mtx_unlock(&g_cache_mutex);
+  *r = rbuf;
+  *rlen = len;
+  return true;
+}
+
+struct cache_pending *cache_pending_create(struct cache_key const *const key) {
+  struct cache_pending *const p = malloc(sizeof(struct cache_pending) + key->exe_path_len + key->len);
+  if (!p) {
+    return NULL;
+  }
+  char *const exe_path = (char *)(p + 1);
+  char *const buf = exe_path + key->exe_path_len;
+  memcpy(exe_path, key->exe_path, key->exe_path_len);
+  memcpy(buf, key->buf, key->len);
+  p->key = *key;
+  p->key.exe_path = exe_path;
+  p->key.buf = buf;
+  p->digest = calc_digest(key);
+  return p;
+}
+
+void cache_pending_destroy(struct cache_pending *const p) { free(p); }
+
+void cache_insert(struct cache_pending *const p,
+                  void const *const r,
+                  size_t const rlen,
+                  void const *const pixels,
+                  size_t const pixels_len) {
+  struct cache_key const *const key = &p->key;
+  size_t const size = sizeof(struct cache_entry) + key->exe_path_len + key->len + rlen + pixels_len;
+  mtx_lock(&g_cache_mutex);
+  size_t const budget = atomic_load_explicit(&g_budget, memory_order_relaxed);
+  if (size > budget) {
+    mtx_unlock(&g_cache_mutex);
+    free(p);
+    return;
+  }
+  struct cache_entry *const old = hashmap_get(&g_cache_map, (char const *)&p->digest, sizeof(p->digest));
+  if (old) {
+    remove_entry(old);
+  }
+  evict(budget - size);
+  struct cache_entry *const e = malloc(size);
+  if (!e) {
+    mtx_unlock(&g_cache_mutex);
+    free(p);
+    return;
+  }
+  e->digest = p->digest;
+  e->size = size;
+  e->exe_path_len = key->exe_path_len;
+  e->len = key->len;
+  e->rlen = rlen;
+  e->pixels_len = pixels ? pixels_len : 0;
+  e->pixel_hash = key->pixel_hash;
+  e->mode = key->mode;
+  e->format = key->format;
+  e->width = key->width;
+  e->height = key->height;
+  char *d = (char *)(e + 1);
+  memcpy(d, key->exe_path, key->exe_path_len);
+  d += key->exe_path_len;
+  memcpy(d, key->buf, key->len);
+  d += key->len;
+  memcpy(d, r, rlen);
+  d += rlen;
+  if (pixels) {
+    memcpy(d, pixels, pixels_len);
+  }
+  if (hashmap_put(&g_cache_map, (char const *)&e->digest, sizeof(e->digest), e) != 0) {
+    free(e);
+  } else {
+    push_front(e);
+    g_bytes += size;
+  }
+  mtx_unlock(&g_cache_mutex);
+  free(p);
+}
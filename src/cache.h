@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cache_key {
+  char const *exe_path;
+  size_t exe_path_len;
+  void const *buf;
+  size_t len;
+  // Only meaningful when the pixels are sent to the child.
+  uint64_t pixel_hash;
+  int32_t mode;
+  int32_t format;
+  int32_t width;
+  int32_t height;
+};
+
+struct cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  size_t entries;
+  size_t bytes;
+  size_t budget;
+  uint32_t padding;
+};
+
+// A copy of the key of a request that missed, waiting for its reply.
+struct cache_pending;
+
+bool cache_init(size_t const budget);
+void cache_exit(void);
+// Evicts least recently used entries until the budget is met. 0 disables the cache.
+void cache_set_budget(size_t const budget);
+bool cache_enabled(void);
+void cache_get_stats(struct cache_stats *const stats);
+// On hit, *r must be released by process_free_buffer and
+// the written-back pixels are copied to pixels if it is not NULL.
+bool cache_lookup(struct cache_key const *const key, void **const r, size_t *const rlen, void *const pixels);
+struct cache_pending *cache_pending_create(struct cache_key const *const key);
+void cache_pending_destroy(struct cache_pending *const p);
+// Stores the reply and consumes p. pixels can be NULL if the request did not write back.
+void cache_insert(struct cache_pending *const p,
+                  void const *const r,
+                  size_t const rlen,
+                  void const *const pixels,
+                  size_t const pixels_len);
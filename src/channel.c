@@ -0,0 +1,68 @@
+#include "channel.h"
+
+#include <string.h>
+
+uint32_t channel_area_size(size_t const size) {
+  // Counters wrap around at 2^32, which has to be a multiple of the size.
+  uint32_t r = 0;
+  for (uint32_t s = 4096; s != 0 && s <= size && s <= UINT32_C(0x40000000); s *= 2) {
+    r = s;
+  }
+  return r;
+}
+
+void channel_init(struct channel *const ch, struct share_mem_header *const h) {
+  uint8_t *const base = (uint8_t *)h;
+  ch->request_area = base + h->request_area_offset;
+  ch->request_size = h->request_area_size;
+  ch->request_write = 0;
+  ch->request_read = 0;
+  ch->reply_area = base + h->reply_area_offset;
+  ch->reply_size = h->reply_area_size;
+  ch->reply_read = 0;
+  ch->shared_reply_read = &h->reply_read;
+  __atomic_store_n(ch->shared_reply_read, 0, __ATOMIC_RELEASE);
+}
+
+bool channel_enabled(struct channel const *const ch) { return ch->request_size && ch->reply_size; }
+
+bool channel_put(struct channel *const ch,
+                 void const *const buf,
+                 size_t const len,
+                 uint32_t *const offset,
+                 uint32_t *const end) {
+  if (len > ch->request_size) {
+    return false;
+  }
+  uint32_t const n = (uint32_t)len;
+  uint32_t const pos = ch->request_write & (ch->request_size - 1);
+  // A payload is never split, skip the rest of the area if it does not fit.
+  uint32_t const skip = ch->request_size - pos < n ? ch->request_size - pos : 0;
+  if (ch->request_write + skip + n - ch->request_read > ch->request_size) {
+    return false;
+  }
+  uint32_t const off = skip ? 0 : pos;
+  memcpy(ch->request_area + off, buf, len);
+  ch->request_write += skip + n;
+  *offset = off;
+  *end = ch->request_write;
+  return true;
+}
+
+void channel_release(struct channel *const ch, uint32_t const end) { ch->request_read = end; }
+
+bool channel_get(struct channel *const ch, uint32_t const offset, uint32_t const size, void *const dest) {
+  if (!ch->reply_size || offset >= ch->reply_size || size > ch->reply_size - offset) {
+    return false;
+  }
+  uint32_t const pos = ch->reply_read & (ch->reply_size - 1);
+  // The child skips the rest of the area in the same way as channel_put.
+  if (offset != pos && offset != 0) {
+    return false;
+  }
+  uint32_t const skip = offset != pos ? ch->reply_size - pos : 0;
+  memcpy(dest, ch->reply_area + offset, size);
+  ch->reply_read += skip + size;
+  __atomic_store_n(ch->shared_reply_read, ch->reply_read, __ATOMIC_RELEASE);
+  return true;
+}
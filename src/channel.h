@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bridge.h"
+
+// Moves request and reply payloads through two ring areas in the shared memory
+// so that only a small descriptor has to go through the pipes.
+struct channel {
+  uint8_t *request_area;
+  uint32_t request_size;
+  // Byte counters, the positions in the area are the counters modulo the size.
+  uint32_t request_write;
+  uint32_t request_read;
+  uint8_t const *reply_area;
+  uint32_t reply_size;
+  uint32_t reply_read;
+  // Published to the child so that it can reuse the reply area.
+  uint32_t *shared_reply_read;
+};
+
+// Rounds size down to a size usable for a ring area.
+uint32_t channel_area_size(size_t const size);
+// Takes the areas from the header and resets every counter, has to be called whenever a new child starts.
+void channel_init(struct channel *const ch, struct share_mem_header *const h);
+bool channel_enabled(struct channel const *const ch);
+// Copies buf to the request area.
+// Returns false if there is not enough free space, the caller should send it through the pipe then.
+// *end has to be passed to channel_release once the child has answered the request.
+bool channel_put(struct channel *const ch,
+                 void const *const buf,
+                 size_t const len,
+                 uint32_t *const offset,
+                 uint32_t *const end);
+void channel_release(struct channel *const ch, uint32_t const end);
+// Copies a reply written by the child at offset to dest and hands the space back to the child.
+bool channel_get(struct channel *const ch, uint32_t const offset, uint32_t const size, void *const dest);
@@ -0,0 +1,214 @@
+#include "doorbell.h"
+
+#include <stdlib.h>
+
+#include "spin.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#elif defined(__linux__)
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#  include <time.h>
+#  include <unistd.h>
+#else
+#  include <time.h>
+#endif
+
+// Requests tend to come in bursts, so the child spins for a while before sleeping.
+#define DOORBELL_SPIN_COUNT 4000
+
+struct doorbell {
+  struct share_mem_header *h;
+#ifdef _WIN32
+  HANDLE request_event;
+  HANDLE reply_event;
+#endif
+  // The bridge counts the requests it has sent, the child the last one it has taken.
+  uint32_t seq;
+};
+
+#ifdef _WIN32
+
+typedef HANDLE event_t;
+
+static bool open_events(struct doorbell *const self, wchar_t const *const name, bool const create) {
+  WCHAR buf[128];
+  wsprintfW(buf, L"%s_request", name);
+  self->request_event = create ? CreateEventW(NULL, FALSE, FALSE, buf) : OpenEventW(EVENT_ALL_ACCESS, FALSE, buf);
+  if (!self->request_event) {
+    return false;
+  }
+  wsprintfW(buf, L"%s_reply", name);
+  self->reply_event = create ? CreateEventW(NULL, FALSE, FALSE, buf) : OpenEventW(EVENT_ALL_ACCESS, FALSE, buf);
+  if (!self->reply_event) {
+    CloseHandle(self->request_event);
+    return false;
+  }
+  return true;
+}
+
+static void sleep_on(event_t const ev, uint32_t *const seq, uint32_t const old, uint32_t const timeout_ms) {
+  (void)seq;
+  (void)old;
+  WaitForSingleObject(ev, timeout_ms);
+}
+
+static void wake(event_t const ev, uint32_t *const seq) {
+  (void)seq;
+  SetEvent(ev);
+}
+
+#else
+
+typedef int event_t;
+
+static void sleep_on(event_t const ev, uint32_t *const seq, uint32_t const old, uint32_t const timeout_ms) {
+  (void)ev;
+  struct timespec const ts = {(time_t)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000000};
+#  ifdef __linux__
+  // Not FUTEX_PRIVATE_FLAG, the word is shared with another process.
+  syscall(SYS_futex, seq, FUTEX_WAIT, old, &ts, NULL, 0);
+#  else
+  // Without futex, poll at a coarse interval.
+  (void)seq;
+  (void)old;
+  struct timespec const interval = {0, 100000};
+  nanosleep(ts.tv_sec || ts.tv_nsec > interval.tv_nsec ? &interval : &ts, NULL);
+#  endif
+}
+
+static void wake(event_t const ev, uint32_t *const seq) {
+  (void)ev;
+#  ifdef __linux__
+  syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+#  else
+  (void)seq;
+#  endif
+}
+
+#endif
+
+// Waits until *seq differs from old. *waiting tells the other side that it has to wake us up.
+static bool wait_change(event_t const ev,
+                        uint32_t *const seq,
+                        uint32_t *const waiting,
+                        uint32_t const old,
+                        int const spins,
+                        uint32_t const timeout_ms) {
+  for (int i = 0; i < spins; ++i) {
+    if (__atomic_load_n(seq, __ATOMIC_ACQUIRE) != old) {
+      return true;
+    }
+    cpu_relax();
+  }
+  __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+  // Pairs with ring, either we see the new value or the other side sees waiting.
+  if (__atomic_load_n(seq, __ATOMIC_SEQ_CST) == old) {
+    sleep_on(ev, seq, old, timeout_ms);
+  }
+  __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+  return __atomic_load_n(seq, __ATOMIC_ACQUIRE) != old;
+}
+
+static void ring(event_t const ev, uint32_t *const seq, uint32_t *const waiting, uint32_t const value) {
+  __atomic_store_n(seq, value, __ATOMIC_SEQ_CST);
+  // Skip the system call while the other side is still spinning.
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+    wake(ev, seq);
+  }
+}
+
+static struct doorbell *doorbell_new(wchar_t const *const name, struct share_mem_header *const h, bool const create) {
+  struct doorbell *const r = calloc(1, sizeof(struct doorbell));
+  if (!r) {
+    return NULL;
+  }
+  r->h = h;
+#ifdef _WIN32
+  if (!open_events(r, name, create)) {
+    free(r);
+    return NULL;
+  }
+#else
+  (void)name;
+  (void)create;
+#endif
+  return r;
+}
+
+struct doorbell *doorbell_create(wchar_t const *const name, struct share_mem_header *const h) {
+  struct doorbell *const r = doorbell_new(name, h, true);
+  if (r) {
+    h->doorbell = 1;
+    h->request_seq = 0;
+    h->reply_seq = 0;
+    h->request_waiting = 0;
+    h->reply_waiting = 0;
+  }
+  return r;
+}
+
+struct doorbell *doorbell_open(wchar_t const *const name, struct share_mem_header *const h) {
+  struct doorbell *const r = doorbell_new(name, h, false);
+  if (r) {
+    // A request may already be waiting, so start from the last answered one.
+    r->seq = __atomic_load_n(&h->reply_seq, __ATOMIC_ACQUIRE);
+  }
+  return r;
+}
+
+void doorbell_destroy(struct doorbell *const self) {
+#ifdef _WIN32
+  CloseHandle(self->request_event);
+  CloseHandle(self->reply_event);
+#endif
+  free(self);
+}
+
+#ifdef _WIN32
+#  define EVENT(self, which) ((self)->which##_event)
+#else
+#  define EVENT(self, which) 0
+#endif
+
+void doorbell_ring_request(struct doorbell *const self, uint32_t const offset, uint32_t const size) {
+  self->h->request_offset = offset;
+  self->h->request_size = size;
+  ring(EVENT(self, request), &self->h->request_seq, &self->h->request_waiting, ++self->seq);
+}
+
+bool doorbell_wait_reply(struct doorbell *const self, uint32_t const timeout_ms) {
+  // The reply sequence number only ever catches up with ours.
+  return wait_change(EVENT(self, reply), &self->h->reply_seq, &self->h->reply_waiting, self->seq - 1, 0, timeout_ms);
+}
+
+bool doorbell_reply_ready(struct doorbell *const self) {
+  return __atomic_load_n(&self->h->reply_seq, __ATOMIC_ACQUIRE) == self->seq;
+}
+
+void doorbell_get_reply(struct doorbell *const self, uint32_t *const offset, uint32_t *const size) {
+  *offset = self->h->reply_offset;
+  *size = self->h->reply_size;
+}
+
+bool doorbell_wait_request(struct doorbell *const self, uint32_t const timeout_ms) {
+  return wait_change(EVENT(self, request),
+                     &self->h->request_seq,
+                     &self->h->request_waiting,
+                     self->seq,
+                     spin_useful() ? DOORBELL_SPIN_COUNT : 0,
+                     timeout_ms);
+}
+
+void doorbell_get_request(struct doorbell *const self, uint32_t *const offset, uint32_t *const size) {
+  self->seq = __atomic_load_n(&self->h->request_seq, __ATOMIC_ACQUIRE);
+  *offset = self->h->request_offset;
+  *size = self->h->request_size;
+}
+
+void doorbell_ring_reply(struct doorbell *const self, uint32_t const offset, uint32_t const size) {
+  self->h->reply_offset = offset;
+  self->h->reply_size = size;
+  ring(EVENT(self, reply), &self->h->reply_seq, &self->h->reply_waiting, self->seq);
+}
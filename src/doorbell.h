@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "bridge.h"
+
+// Announces requests and replies by the sequence numbers in the shared header instead of the pipes.
+// The payloads themselves go through the channel.
+// On Windows the waiting side sleeps on the events named name + L"_request" and name + L"_reply",
+// on Linux it sleeps on the sequence numbers with futex.
+struct doorbell;
+
+// Used by the bridge, creates the events and marks the header.
+struct doorbell *doorbell_create(wchar_t const *const name, struct share_mem_header *const h);
+// Used by the child, opens the events created by doorbell_create.
+struct doorbell *doorbell_open(wchar_t const *const name, struct share_mem_header *const h);
+void doorbell_destroy(struct doorbell *const self);
+
+// The bridge side, only one request may be in flight.
+void doorbell_ring_request(struct doorbell *const self, uint32_t const offset, uint32_t const size);
+// Returns false if the reply has not arrived within timeout_ms.
+// It sleeps right away, poll doorbell_reply_ready first to avoid the wake-up latency.
+bool doorbell_wait_reply(struct doorbell *const self, uint32_t const timeout_ms);
+bool doorbell_reply_ready(struct doorbell *const self);
+void doorbell_get_reply(struct doorbell *const self, uint32_t *const offset, uint32_t *const size);
+
+// The child side.
+// Returns false if no request has arrived within timeout_ms.
+bool doorbell_wait_request(struct doorbell *const self, uint32_t const timeout_ms);
+// Takes the request that doorbell_wait_request reported.
+void doorbell_get_request(struct doorbell *const self, uint32_t *const offset, uint32_t *const size);
+void doorbell_ring_reply(struct doorbell *const self, uint32_t const offset, uint32_t const size);
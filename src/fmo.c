@@ -0,0 +1,115 @@
+#include "fmo.h"
+
+#ifdef _WIN32
+
+#  include <windows.h>
+
+struct fmo {
+  HANDLE handle;
+  void *view;
+  size_t size;
+};
+
+struct fmo *fmo_create(wchar_t const *const name, size_t const size) {
+  struct fmo *const r = calloc(1, sizeof(struct fmo));
+  if (!r) {
+    return NULL;
+  }
+  r->handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+  if (!r->handle) {
+    free(r);
+    return NULL;
+  }
+  if (GetLastError() == ERROR_ALREADY_EXISTS) {
+    // Someone else owns this name, the size may not match.
+    CloseHandle(r->handle);
+    free(r);
+    return NULL;
+  }
+  r->view = MapViewOfFile(r->handle, FILE_MAP_WRITE, 0, 0, 0);
+  if (!r->view) {
+    CloseHandle(r->handle);
+    free(r);
+    return NULL;
+  }
+  r->size = size;
+  return r;
+}
+
+void fmo_destroy(struct fmo *const self) {
+  if (self->view) {
+    UnmapViewOfFile(self->view);
+    self->view = NULL;
+  }
+  if (self->handle) {
+    CloseHandle(self->handle);
+    self->handle = NULL;
+  }
+  free(self);
+}
+
+#else
+
+#  include <fcntl.h>
+#  include <stdlib.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+
+struct fmo {
+  int fd;
+  void *view;
+  size_t size;
+  // "/" followed by the name, shm_open needs the slash to be portable.
+  char name[256];
+};
+
+struct fmo *fmo_create(wchar_t const *const name, size_t const size) {
+  struct fmo *const r = calloc(1, sizeof(struct fmo));
+  if (!r) {
+    return NULL;
+  }
+  r->name[0] = '/';
+  size_t const len = wcstombs(r->name + 1, name, sizeof(r->name) - 2);
+  if (len == (size_t)-1) {
+    free(r);
+    return NULL;
+  }
+  r->name[len + 1] = '\0';
+  // O_EXCL fails if someone else owns this name, the size may not match.
+  r->fd = shm_open(r->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (r->fd == -1) {
+    free(r);
+    return NULL;
+  }
+  if (ftruncate(r->fd, (off_t)size) == -1) {
+    goto cleanup;
+  }
+  r->view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+  if (r->view == MAP_FAILED) {
+    goto cleanup;
+  }
+  r->size = size;
+  return r;
+cleanup:
+  close(r->fd);
+  shm_unlink(r->name);
+  free(r);
+  return NULL;
+}
+
+void fmo_destroy(struct fmo *const self) {
+  if (self->view) {
+    munmap(self->view, self->size);
+    self->view = NULL;
+  }
+  close(self->fd);
+  // Children that have mapped it keep their mapping.
+  shm_unlink(self->name);
+  free(self);
+}
+
+#endif
+
+void *fmo_view(struct fmo const *const self) { return self->view; }
+
+size_t fmo_size(struct fmo const *const self) { return self->size; }
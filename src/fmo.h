@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <wchar.h>
+
+struct fmo;
+
+struct fmo *fmo_create(wchar_t const *const name, size_t const size);
+void fmo_destroy(struct fmo *const self);
+void *fmo_view(struct fmo const *const self);
+size_t fmo_size(struct fmo const *const self);
@@ -0,0 +1,207 @@
+#include "hash.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+uint64_t cyrb64(uint32_t const *const src, size_t const len, uint32_t const seed) {
+  uint32_t h1 = 0x91eb9dc7 ^ seed, h2 = 0x41c6ce57 ^ seed;
+  for (size_t i = 0; i < len; ++i) {
+    h1 = (h1 ^ src[i]) * 2654435761;
+    h2 = (h2 ^ src[i]) * 1597334677;
+  }
+  h1 = ((h1 ^ (h1 >> 16)) * 2246822507) ^ ((h2 ^ (h2 >> 13)) * 3266489909);
+  h2 = ((h2 ^ (h2 >> 16)) * 2246822507) ^ ((h1 ^ (h1 >> 13)) * 3266489909);
+  return (((uint64_t)h2) << 32) | ((uint64_t)h1);
+}
+
+uint64_t cyrb64_bytes(void const *const src, size_t const len, uint32_t const seed) {
+  uint32_t h1 = 0x91eb9dc7 ^ seed, h2 = 0x41c6ce57 ^ seed;
+  uint8_t const *p = src;
+  for (size_t i = 0; i < len; i += 4, p += 4) {
+    uint32_t v = 0;
+    memcpy(&v, p, len - i < 4 ? len - i : 4);
+    h1 = (h1 ^ v) * 2654435761;
+    h2 = (h2 ^ v) * 1597334677;
+  }
+  h1 = ((h1 ^ (h1 >> 16)) * 2246822507) ^ ((h2 ^ (h2 >> 13)) * 3266489909);
+  h2 = ((h2 ^ (h2 >> 16)) * 2246822507) ^ ((h1 ^ (h1 >> 13)) * 3266489909);
+  return (((uint64_t)h2) << 32) | ((uint64_t)h1);
+}
+
+// cyrb64_wide runs NUM_LANES independent cyrb64 style states over interleaved words
+// so that the multiplications do not depend on each other, then folds the states with cyrb64.
+// Every implementation below must produce exactly the same result.
+#define NUM_LANES 16
+
+static void lanes_init(uint32_t *const a, uint32_t *const b, uint32_t const seed) {
+  for (uint32_t i = 0; i < NUM_LANES; ++i) {
+    a[i] = (0x91eb9dc7 ^ seed) + i * 0x9e3779b9;
+    b[i] = (0x41c6ce57 ^ seed) + i * 0x7f4a7c15;
+  }
+}
+
+static void lanes_update(uint32_t *const a, uint32_t *const b, uint32_t const *const src, size_t const n) {
+  for (size_t i = 0; i < n; ++i) {
+    a[i] = (a[i] ^ src[i]) * 2654435761;
+    b[i] = (b[i] ^ src[i]) * 1597334677;
+  }
+}
+
+static uint64_t lanes_final(uint32_t const *const a, uint32_t const *const b, size_t const len, uint32_t const seed) {
+  uint32_t v[NUM_LANES * 2];
+  memcpy(v, a, sizeof(uint32_t) * NUM_LANES);
+  memcpy(v + NUM_LANES, b, sizeof(uint32_t) * NUM_LANES);
+  return cyrb64(v, NUM_LANES * 2, seed ^ (uint32_t)len ^ (uint32_t)((uint64_t)len >> 32));
+}
+
+static void lanes_blocks_scalar(uint32_t *const a, uint32_t *const b, uint32_t const *const src, size_t const blocks) {
+  for (size_t i = 0; i < blocks; ++i) {
+    lanes_update(a, b, src + i * NUM_LANES, NUM_LANES);
+  }
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#  include <immintrin.h>
+
+__attribute__((target("sse2"))) static inline __m128i mullo32_sse2(__m128i const a, __m128i const b) {
+  __m128i const even = _mm_mul_epu32(a, b);
+  __m128i const odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2"))) static void
+lanes_blocks_sse2(uint32_t *const a, uint32_t *const b, uint32_t const *const src, size_t const blocks) {
+  __m128i const ka = _mm_set1_epi32((int)2654435761);
+  __m128i const kb = _mm_set1_epi32(1597334677);
+  __m128i a0 = _mm_loadu_si128((void const *)(a + 0)), a1 = _mm_loadu_si128((void const *)(a + 4));
+  __m128i a2 = _mm_loadu_si128((void const *)(a + 8)), a3 = _mm_loadu_si128((void const *)(a + 12));
+  __m128i b0 = _mm_loadu_si128((void const *)(b + 0)), b1 = _mm_loadu_si128((void const *)(b + 4));
+  __m128i b2 = _mm_loadu_si128((void const *)(b + 8)), b3 = _mm_loadu_si128((void const *)(b + 12));
+  for (size_t i = 0; i < blocks; ++i) {
+    uint32_t const *const p = src + i * NUM_LANES;
+    __m128i const v0 = _mm_loadu_si128((void const *)(p + 0));
+    __m128i const v1 = _mm_loadu_si128((void const *)(p + 4));
+    __m128i const v2 = _mm_loadu_si128((void const *)(p + 8));
+    __m128i const v3 = _mm_loadu_si128((void const *)(p + 12));
+    a0 = mullo32_sse2(_mm_xor_si128(a0, v0), ka);
+    a1 = mullo32_sse2(_mm_xor_si128(a1, v1), ka);
+    a2 = mullo32_sse2(_mm_xor_si128(a2, v2), ka);
+    a3 = mullo32_sse2(_mm_xor_si128(a3, v3), ka);
+    b0 = mullo32_sse2(_mm_xor_si128(b0, v0), kb);
+    b1 = mullo32_sse2(_mm_xor_si128(b1, v1), kb);
+    b2 = mullo32_sse2(_mm_xor_si128(b2, v2), kb);
+    b3 = mullo32_sse2(_mm_xor_si128(b3, v3), kb);
+  }
+  _mm_storeu_si128((void *)(a + 0), a0);
+  _mm_storeu_si128((void *)(a + 4), a1);
+  _mm_storeu_si128((void *)(a + 8), a2);
+  _mm_storeu_si128((void *)(a + 12), a3);
+  _mm_storeu_si128((void *)(b + 0), b0);
+  _mm_storeu_si128((void *)(b + 4), b1);
+  _mm_storeu_si128((void *)(b + 8), b2);
+  _mm_storeu_si128((void *)(b + 12), b3);
+}
+
+__attribute__((target("avx2"))) static void
+lanes_blocks_avx2(uint32_t *const a, uint32_t *const b, uint32_t const *const src, size_t const blocks) {
+  __m256i const ka = _mm256_set1_epi32((int)2654435761);
+  __m256i const kb = _mm256_set1_epi32(1597334677);
+  __m256i a0 = _mm256_loadu_si256((void const *)(a + 0)), a1 = _mm256_loadu_si256((void const *)(a + 8));
+  __m256i b0 = _mm256_loadu_si256((void const *)(b + 0)), b1 = _mm256_loadu_si256((void const *)(b + 8));
+  for (size_t i = 0; i < blocks; ++i) {
+    uint32_t const *const p = src + i * NUM_LANES;
+    __m256i const v0 = _mm256_loadu_si256((void const *)(p + 0));
+    __m256i const v1 = _mm256_loadu_si256((void const *)(p + 8));
+    a0 = _mm256_mullo_epi32(_mm256_xor_si256(a0, v0), ka);
+    a1 = _mm256_mullo_epi32(_mm256_xor_si256(a1, v1), ka);
+    b0 = _mm256_mullo_epi32(_mm256_xor_si256(b0, v0), kb);
+    b1 = _mm256_mullo_epi32(_mm256_xor_si256(b1, v1), kb);
+  }
+  _mm256_storeu_si256((void *)(a + 0), a0);
+  _mm256_storeu_si256((void *)(a + 8), a1);
+  _mm256_storeu_si256((void *)(b + 0), b0);
+  _mm256_storeu_si256((void *)(b + 8), b1);
+}
+#endif
+
+typedef void (*lanes_blocks_func)(uint32_t *const a, uint32_t *const b, uint32_t const *const src, size_t const blocks);
+
+static lanes_blocks_func get_lanes_blocks(enum hash_impl const impl) {
+  switch (impl) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  case HASH_IMPL_AVX2:
+    return lanes_blocks_avx2;
+  case HASH_IMPL_SSE2:
+    return lanes_blocks_sse2;
+#else
+  case HASH_IMPL_AVX2:
+  case HASH_IMPL_SSE2:
+#endif
+  case HASH_IMPL_SCALAR:
+    break;
+  }
+  return lanes_blocks_scalar;
+}
+
+enum hash_impl hash_best_impl(void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return HASH_IMPL_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return HASH_IMPL_SSE2;
+  }
+#endif
+  return HASH_IMPL_SCALAR;
+}
+
+static lanes_blocks_func best_lanes_blocks(void) {
+  // Detection is idempotent, racing threads just store the same value.
+  // The pointer only refers to code, so relaxed ordering is enough.
+  static _Atomic(lanes_blocks_func) cached = NULL;
+  lanes_blocks_func f = atomic_load_explicit(&cached, memory_order_relaxed);
+  if (!f) {
+    f = get_lanes_blocks(hash_best_impl());
+    atomic_store_explicit(&cached, f, memory_order_relaxed);
+  }
+  return f;
+}
+
+static uint64_t wide(uint32_t const *const src, size_t const len, uint32_t const seed, lanes_blocks_func const blocks) {
+  uint32_t a[NUM_LANES], b[NUM_LANES];
+  lanes_init(a, b, seed);
+  size_t const n = len / NUM_LANES;
+  blocks(a, b, src, n);
+  lanes_update(a, b, src + n * NUM_LANES, len % NUM_LANES);
+  return lanes_final(a, b, len, seed);
+}
+
+uint64_t cyrb64_wide_impl(uint32_t const *const src, size_t const len, uint32_t const seed, enum hash_impl const impl) {
+  // Instructions the CPU lacks would raise SIGILL.
+  enum hash_impl const best = hash_best_impl();
+  return wide(src, len, seed, get_lanes_blocks(impl > best ? best : impl));
+}
+
+uint64_t cyrb64_wide(uint32_t const *const src, size_t const len, uint32_t const seed) {
+  return wide(src, len, seed, best_lanes_blocks());
+}
+
+uint64_t cyrb64_rect(void const *const src,
+                     size_t const stride,
+                     size_t const width,
+                     size_t const height,
+                     uint32_t const seed) {
+  lanes_blocks_func const blocks = best_lanes_blocks();
+  uint32_t a[NUM_LANES], b[NUM_LANES];
+  lanes_init(a, b, seed);
+  size_t const n = width / NUM_LANES;
+  uint8_t const *row = src;
+  for (size_t y = 0; y < height; ++y, row += stride) {
+    uint32_t const *const p = (void const *)row;
+    blocks(a, b, p, n);
+    lanes_update(a, b, p + n * NUM_LANES, width % NUM_LANES);
+  }
+  return lanes_final(a, b, width * height, seed);
+}
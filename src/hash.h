@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Seed used by calc_hash, pixel hashes computed inside the bridge use the same one.
+#define PIXEL_HASH_SEED 0x3fc0b49e
+
+uint64_t cyrb64(uint32_t const *const src, size_t const len, uint32_t const seed);
+// Same as cyrb64 but accepts any length, the trailing bytes are zero padded.
+uint64_t cyrb64_bytes(void const *const src, size_t const len, uint32_t const seed);
+
+enum hash_impl {
+  HASH_IMPL_SCALAR,
+  HASH_IMPL_SSE2,
+  HASH_IMPL_AVX2,
+};
+
+// Faster than cyrb64 on large inputs but produces different values.
+// The best implementation for the running CPU is used, every implementation gives the same result.
+uint64_t cyrb64_wide(uint32_t const *const src, size_t const len, uint32_t const seed);
+// Forces a specific implementation, mainly for benchmarks.
+// Asking for more than hash_best_impl() returns gets hash_best_impl() instead, and scalar if not compiled in.
+uint64_t cyrb64_wide_impl(uint32_t const *const src, size_t const len, uint32_t const seed, enum hash_impl const impl);
+enum hash_impl hash_best_impl(void);
+// Hashes a width x height rectangle of 32-bit words whose rows are stride bytes apart.
+uint64_t cyrb64_rect(void const *const src,
+                     size_t const stride,
+                     size_t const width,
+                     size_t const height,
+                     uint32_t const seed);
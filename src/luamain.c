@@ -3,6 +3,7 @@
 #include <windows.h>
 
 #include "bridge.h"
+#include "hash.h"
 #include "ods.h"
 
 static bool initialized = false;
@@ -34,22 +35,110 @@ static int lua_bridge_call_error(lua_State *L, int err) {
     return luaL_error(L, "could not send command to child process");
   case ECALL_FAILED_TO_RECEIVE_COMMAND:
     return luaL_error(L, "could not receive reply from child process");
+  case ECALL_IMAGE_TOO_LARGE:
+    return luaL_error(L, "image is larger than the shared memory");
+  case ECALL_INVALID_POOL_SIZE:
+    return luaL_error(L, "invalid pool size or the shared memory of the pool is too large");
   }
   return luaL_error(L, "unexpected error code");
 }
 
-static int lua_bridge_call(lua_State *L) {
-  if (!initialized) {
-    lua_getglobal(L, "obj");
-    lua_getfield(L, -1, "getinfo");
-    lua_pushstring(L, "image_max");
-    lua_call(L, 1, 2);
-    if (!bridge_init(lua_tointeger(L, -2), lua_tointeger(L, -1))) {
-      return luaL_error(L, "failed to initialize bridge.dll");
+static void ensure_initialized(lua_State *L) {
+  if (initialized) {
+    return;
+  }
+  lua_getglobal(L, "obj");
+  lua_getfield(L, -1, "getinfo");
+  lua_pushstring(L, "image_max");
+  lua_call(L, 1, 2);
+  if (!bridge_init(lua_tointeger(L, -2), lua_tointeger(L, -1))) {
+    luaL_error(L, "failed to initialize bridge.dll");
+    return;
+  }
+  lua_pop(L, 3);
+  initialized = true;
+}
+
+// Reads the optional flags and pixel arguments of call / call_async starting at index 3.
+// Returns false if no pixel data is involved.
+// When obj.getpixeldata is used, obj and the pixel buffer are left on the stack in this order.
+static bool get_call_mem(lua_State *L, struct call_mem *const m, int32_t *const flags) {
+  *flags = 0;
+  if (!lua_isstring(L, 3)) {
+    return false;
+  }
+  size_t mflen;
+  const char *mf = lua_tolstring(L, 3, &mflen);
+  int32_t mode = 0;
+  enum pixel_format format = PIXEL_FORMAT_BGRA;
+  for (size_t i = 0; i < mflen; ++i) {
+    switch (mf[i]) {
+    case 'r':
+    case 'R':
+      mode |= MEM_MODE_READ;
+      break;
+    case 'w':
+    case 'W':
+      mode |= MEM_MODE_WRITE;
+      break;
+    case 'p':
+    case 'P':
+      mode |= MEM_MODE_DIRECT;
+      break;
+    case 'c':
+    case 'C':
+      *flags |= CALL_FLAG_CACHE;
+      break;
+    case 'd':
+    case 'D':
+      *flags |= CALL_FLAG_DELTA;
+      break;
+    case 'a':
+    case 'A':
+      format = PIXEL_FORMAT_PREMULTIPLIED;
+      break;
+    case 'l':
+    case 'L':
+      format = PIXEL_FORMAT_PLANAR;
+      break;
+    case 'f':
+    case 'F':
+      format = PIXEL_FORMAT_FLOAT;
+      break;
     }
-    lua_pop(L, 2);
-    initialized = true;
   }
+  if (!(mode & (MEM_MODE_READ | MEM_MODE_WRITE))) {
+    return false;
+  }
+  m->mode = mode;
+  m->format = format;
+  if (mode & MEM_MODE_DIRECT) {
+    m->buf = deconst(lua_topointer(L, 4));
+    m->width = lua_tointeger(L, 5);
+    m->height = lua_tointeger(L, 6);
+    if (!m->buf || m->width == 0 || m->height == 0) {
+      luaL_error(L, "invalid arguments");
+    }
+    return true;
+  }
+  lua_getglobal(L, "obj");
+  lua_getfield(L, -1, "w");
+  lua_getfield(L, -2, "h");
+  if (lua_tointeger(L, -1) == 0 || lua_tointeger(L, -2) == 0) {
+    luaL_error(L, "has no image");
+  }
+  lua_pop(L, 2);
+  lua_getfield(L, -1, "getpixeldata");
+  lua_call(L, 0, 3);
+  m->buf = deconst(lua_topointer(L, -3));
+  m->width = lua_tointeger(L, -2);
+  m->height = lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return true;
+}
+
+static int lua_bridge_call(lua_State *L) {
+  ensure_initialized(L);
 
   const char *exe_path = lua_tostring(L, 1);
   if (!exe_path) {
@@ -58,86 +147,471 @@ static int lua_bridge_call(lua_State *L) {
   size_t buflen;
   const char *buf = lua_tolstring(L, 2, &buflen);
 
-  if (lua_isstring(L, 3)) {
-    size_t mflen;
-    const char *mf = lua_tolstring(L, 3, &mflen);
-    int32_t mode = 0;
-    for (size_t i = 0; i < mflen; ++i) {
-      switch (mf[i]) {
-      case 'r':
-      case 'R':
-        mode |= MEM_MODE_READ;
-        break;
-      case 'w':
-      case 'W':
-        mode |= MEM_MODE_WRITE;
-        break;
-      case 'p':
-      case 'P':
-        mode |= MEM_MODE_DIRECT;
-        break;
-      }
-    }
-    if (mode & (MEM_MODE_READ | MEM_MODE_WRITE)) {
-      struct call_mem m;
-      m.mode = mode;
-      if (mode & MEM_MODE_DIRECT) {
-        m.buf = deconst(lua_topointer(L, 4));
-        m.width = lua_tointeger(L, 5);
-        m.height = lua_tointeger(L, 6);
-        if (!m.buf || m.width == 0 || m.height == 0) {
-          return luaL_error(L, "invalid arguments");
-        }
-      } else {
-        lua_getglobal(L, "obj");
-        lua_getfield(L, -1, "w");
-        lua_getfield(L, -2, "h");
-        if (lua_tointeger(L, -1) == 0 || lua_tointeger(L, -2) == 0) {
-          return luaL_error(L, "has no image");
-        }
-        lua_pop(L, 2);
-        lua_getfield(L, -1, "getpixeldata");
-        lua_call(L, 0, 3);
-        m.buf = deconst(lua_topointer(L, -3));
-        m.width = lua_tointeger(L, -2);
-        m.height = lua_tointeger(L, -1);
-        lua_pop(L, 2);
-      }
-      int32_t rlen = 0;
-      void *r = NULL;
-      const int err = bridge_call(exe_path, buf, (int32_t)buflen, &m, &r, &rlen);
-      if (err != ECALL_OK) {
-        return lua_bridge_call_error(L, err);
-      }
-      if (m.mode & MEM_MODE_WRITE && !(m.mode & MEM_MODE_DIRECT)) {
-        lua_getfield(L, -2, "putpixeldata");
-        lua_pushvalue(L, -2);
-        lua_call(L, 1, 0);
-      }
-      lua_pushlstring(L, r, (size_t)rlen);
-      return 1;
+  struct call_mem m;
+  int32_t flags;
+  bool const has_mem = get_call_mem(L, &m, &flags);
+  int32_t rlen = 0;
+  void *r = NULL;
+  int const err = bridge_call(exe_path, buf, (int32_t)buflen, has_mem ? &m : NULL, flags, &r, &rlen);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  if (has_mem && m.mode & MEM_MODE_WRITE && !(m.mode & MEM_MODE_DIRECT) && !m.unchanged) {
+    uint64_t const start = bridge_stats_begin();
+    lua_getfield(L, -2, "putpixeldata");
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 0);
+    bridge_stats_end(exe_path, BRIDGE_PHASE_PUTPIXELDATA, start);
+  }
+  uint64_t const start = bridge_stats_begin();
+  lua_pushlstring(L, r, (size_t)rlen);
+  bridge_stats_end(exe_path, BRIDGE_PHASE_LUA_PUSH, start);
+  bridge_free_reply(r);
+  return 1;
+}
+
+static int lua_bridge_call_batch(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  size_t const n = lua_objlen(L, 2);
+  if (n == 0) {
+    lua_newtable(L);
+    return 1;
+  }
+  // Strings stay referenced by the table at index 2 while we use them.
+  // Numbers are rejected, lua_tolstring would convert them into new strings that nothing references once popped.
+  void const **const bufs = lua_newuserdata(L, n * sizeof(void *));
+  void **const r = lua_newuserdata(L, n * sizeof(void *));
+  int32_t *const lens = lua_newuserdata(L, n * 2 * sizeof(int32_t));
+  int32_t *const rlen = lens + n;
+  for (size_t i = 0; i < n; ++i) {
+    lua_rawgeti(L, 2, (int)(i + 1));
+    if (lua_type(L, -1) != LUA_TSTRING) {
+      return luaL_error(L, "batch item #%d is not a string", (int)(i + 1));
     }
+    size_t len;
+    bufs[i] = lua_tolstring(L, -1, &len);
+    lens[i] = (int32_t)len;
+    lua_pop(L, 1);
+  }
+  int const err = bridge_call_batch(exe_path, bufs, lens, n, r, rlen);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  lua_createtable(L, (int)n, 0);
+  for (size_t i = 0; i < n; ++i) {
+    lua_pushlstring(L, r[i], (size_t)rlen[i]);
+    bridge_free_reply(r[i]);
+    lua_rawseti(L, -2, (int)(i + 1));
+  }
+  return 1;
+}
+
+static int lua_bridge_pool(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  lua_Integer const n = luaL_checkinteger(L, 2);
+  if (n <= 0) {
+    return luaL_error(L, "invalid pool size or the shared memory of the pool is too large");
+  }
+  int const err = bridge_set_pool_size(exe_path, (size_t)n);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
   }
+  return 0;
+}
+
+static int lua_bridge_sync(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  int const err = bridge_set_sync(exe_path, lua_isnoneornil(L, 2) || lua_toboolean(L, 2));
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  return 0;
+}
+
+static int lua_bridge_doorbell(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  int const err = bridge_set_doorbell(exe_path, lua_isnoneornil(L, 2) || lua_toboolean(L, 2));
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  return 0;
+}
+
+static int lua_bridge_wait_policy(lua_State *L) {
+  ensure_initialized(L);
 
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  static char const *const names[] = {"adaptive", "block", "spin", NULL};
+  static enum wait_policy const policies[] = {WAIT_POLICY_ADAPTIVE, WAIT_POLICY_BLOCK, WAIT_POLICY_SPIN};
+  int const policy = luaL_checkoption(L, 2, NULL, names);
+  lua_Integer const spins = luaL_optinteger(L, 3, BRIDGE_DEFAULT_SPINS);
+  if (spins < 0) {
+    return luaL_error(L, "invalid spin count");
+  }
+  int const err = bridge_set_wait_policy(exe_path, policies[policy], (uint32_t)spins);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  return 0;
+}
+
+static int lua_bridge_channel(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  lua_Integer const size = luaL_checkinteger(L, 2);
+  if (size < 0) {
+    return luaL_error(L, "invalid channel size");
+  }
+  int const err = bridge_set_channel_size(exe_path, (size_t)size);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  return 0;
+}
+
+static int lua_bridge_preload(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  size_t buflen = 0;
+  const char *buf = lua_isnoneornil(L, 2) ? NULL : lua_tolstring(L, 2, &buflen);
+  int const err = bridge_preload(exe_path, buf, (int32_t)buflen);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  return 0;
+}
+
+static int lua_bridge_ready(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  int const err = bridge_ready(exe_path);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  return 0;
+}
+
+static int lua_bridge_cache_budget(lua_State *L) {
+  ensure_initialized(L);
+
+  lua_Number const budget = luaL_checknumber(L, 1);
+  // Also rejects NaN and the infinities, converting them to size_t is undefined.
+  if (!(budget >= 0 && budget < (lua_Number)SIZE_MAX)) {
+    return luaL_error(L, "invalid cache budget");
+  }
+  bridge_set_cache_budget((size_t)budget);
+  return 0;
+}
+
+static int lua_bridge_cache_stats(lua_State *L) {
+  ensure_initialized(L);
+
+  struct bridge_cache_stats stats;
+  bridge_get_cache_stats(&stats);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, (lua_Number)stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)stats.entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, (lua_Number)stats.bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)stats.budget);
+  lua_setfield(L, -2, "budget");
+  return 1;
+}
+
+static int lua_bridge_buffer_stats(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  struct bridge_buffer_stats stats;
+  int const err = bridge_get_buffer_stats(exe_path, &stats);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  lua_createtable(L, 0, 2);
+  lua_pushnumber(L, (lua_Number)stats.pooled);
+  lua_setfield(L, -2, "pooled");
+  lua_pushnumber(L, (lua_Number)stats.in_use);
+  lua_setfield(L, -2, "in_use");
+  return 1;
+}
+
+static int lua_bridge_wait_stats(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  struct bridge_wait_stats stats;
+  int const err = bridge_get_wait_stats(exe_path, &stats);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  lua_createtable(L, 0, 2);
+  lua_pushnumber(L, (lua_Number)stats.spin_succeeded);
+  lua_setfield(L, -2, "spin_succeeded");
+  lua_pushnumber(L, (lua_Number)stats.blocked);
+  lua_setfield(L, -2, "blocked");
+  return 1;
+}
+
+static void push_latency(lua_State *L, struct bridge_latency const *const l) {
+  lua_createtable(L, 0, 8);
+  lua_pushnumber(L, (lua_Number)l->count);
+  lua_setfield(L, -2, "count");
+  // Microseconds are easier to read in scripts.
+  lua_pushnumber(L, (lua_Number)l->min_ns / 1000);
+  lua_setfield(L, -2, "min");
+  lua_pushnumber(L, (lua_Number)l->max_ns / 1000);
+  lua_setfield(L, -2, "max");
+  lua_pushnumber(L, (lua_Number)l->mean_ns / 1000);
+  lua_setfield(L, -2, "mean");
+  lua_pushnumber(L, (lua_Number)l->p50_ns / 1000);
+  lua_setfield(L, -2, "p50");
+  lua_pushnumber(L, (lua_Number)l->p90_ns / 1000);
+  lua_setfield(L, -2, "p90");
+  lua_pushnumber(L, (lua_Number)l->p99_ns / 1000);
+  lua_setfield(L, -2, "p99");
+  lua_pushnumber(L, (lua_Number)l->p999_ns / 1000);
+  lua_setfield(L, -2, "p999");
+}
+
+static void push_stats(lua_State *L, struct bridge_stats const *const stats) {
+  lua_createtable(L, 0, 7 + BRIDGE_PHASE_COUNT);
+  lua_pushnumber(L, (lua_Number)stats->calls);
+  lua_setfield(L, -2, "calls");
+  lua_pushnumber(L, (lua_Number)stats->bytes_in);
+  lua_setfield(L, -2, "bytes_in");
+  lua_pushnumber(L, (lua_Number)stats->bytes_out);
+  lua_setfield(L, -2, "bytes_out");
+  lua_pushnumber(L, (lua_Number)stats->spawns);
+  lua_setfield(L, -2, "spawns");
+  lua_pushnumber(L, (lua_Number)stats->respawns);
+  lua_setfield(L, -2, "respawns");
+  for (int i = 0; i < BRIDGE_PHASE_COUNT; ++i) {
+    push_latency(L, &stats->phases[i]);
+    lua_setfield(L, -2, bridge_phase_name((enum bridge_phase)i));
+  }
+  lua_createtable(L, 0, 2);
+  lua_pushnumber(L, (lua_Number)stats->buffers.pooled);
+  lua_setfield(L, -2, "pooled");
+  lua_pushnumber(L, (lua_Number)stats->buffers.in_use);
+  lua_setfield(L, -2, "in_use");
+  lua_setfield(L, -2, "buffers");
+  lua_createtable(L, 0, 2);
+  lua_pushnumber(L, (lua_Number)stats->waits.spin_succeeded);
+  lua_setfield(L, -2, "spin_succeeded");
+  lua_pushnumber(L, (lua_Number)stats->waits.blocked);
+  lua_setfield(L, -2, "blocked");
+  lua_setfield(L, -2, "waits");
+}
+
+static bool push_stats_callback(void *const userdata,
+                                char const *const exe_path,
+                                size_t const exe_path_len,
+                                struct bridge_stats const *const stats) {
+  lua_State *L = userdata;
+  lua_pushlstring(L, exe_path, exe_path_len);
+  push_stats(L, stats);
+  lua_rawset(L, -3);
+  return true;
+}
+
+static int lua_bridge_stats(lua_State *L) {
+  ensure_initialized(L);
+
+  if (lua_isnoneornil(L, 1)) {
+    lua_newtable(L);
+    bridge_foreach_stats(push_stats_callback, L);
+    return 1;
+  }
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  struct bridge_stats stats;
+  int const err = bridge_get_stats(exe_path, &stats);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  push_stats(L, &stats);
+  return 1;
+}
+
+static int lua_bridge_stats_enable(lua_State *L) {
+  ensure_initialized(L);
+  bridge_set_stats_enabled(lua_isnoneornil(L, 1) || lua_toboolean(L, 1));
+  return 0;
+}
+
+static int lua_bridge_stats_reset(lua_State *L) {
+  ensure_initialized(L);
+  bridge_reset_stats();
+  return 0;
+}
+
+static int lua_bridge_trace_start(lua_State *L) {
+  ensure_initialized(L);
+  char const *const path = luaL_checkstring(L, 1);
+  lua_pushboolean(L, bridge_trace_start(path));
+  return 1;
+}
+
+static int lua_bridge_trace_stop(lua_State *L) {
+  ensure_initialized(L);
+  lua_pushboolean(L, bridge_trace_stop());
+  return 1;
+}
+
+#define TICKET_METATABLE "bridge.ticket"
+
+struct lua_ticket {
+  struct bridge_ticket *t;
+  // Reference to the obj.getpixeldata buffer that has to be passed to obj.putpixeldata.
+  int pixel_ref;
+  // Reference to the exe path, kept together with pixel_ref to record the time of obj.putpixeldata.
+  int exe_ref;
+};
+
+static void lua_ticket_release(lua_State *L, struct lua_ticket *const lt) {
+  if (lt->pixel_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, lt->pixel_ref);
+    lt->pixel_ref = LUA_NOREF;
+  }
+  if (lt->exe_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, lt->exe_ref);
+    lt->exe_ref = LUA_NOREF;
+  }
+}
+
+static int lua_ticket_gc(lua_State *L) {
+  struct lua_ticket *const lt = luaL_checkudata(L, 1, TICKET_METATABLE);
+  if (lt->t) {
+    bridge_cancel(lt->t);
+    lt->t = NULL;
+  }
+  lua_ticket_release(L, lt);
+  return 0;
+}
+
+static int lua_bridge_call_async(lua_State *L) {
+  ensure_initialized(L);
+
+  const char *exe_path = lua_tostring(L, 1);
+  if (!exe_path) {
+    return luaL_error(L, "invalid exe path");
+  }
+  size_t buflen;
+  const char *buf = lua_tolstring(L, 2, &buflen);
+
+  struct call_mem m;
+  int32_t flags;
+  bool const has_mem = get_call_mem(L, &m, &flags);
+  struct lua_ticket *const lt = lua_newuserdata(L, sizeof(struct lua_ticket));
+  lt->t = NULL;
+  lt->pixel_ref = LUA_NOREF;
+  lt->exe_ref = LUA_NOREF;
+  luaL_getmetatable(L, TICKET_METATABLE);
+  lua_setmetatable(L, -2);
+  int const err = bridge_call_async(exe_path, buf, (int32_t)buflen, has_mem ? &m : NULL, flags, &lt->t);
+  if (err != ECALL_OK) {
+    return lua_bridge_call_error(L, err);
+  }
+  if (has_mem && m.mode & MEM_MODE_WRITE && !(m.mode & MEM_MODE_DIRECT)) {
+    lua_pushvalue(L, -2);
+    lt->pixel_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_pushvalue(L, 1);
+  lt->exe_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+static int lua_bridge_wait(lua_State *L) {
+  struct lua_ticket *const lt = luaL_checkudata(L, 1, TICKET_METATABLE);
+  if (!lt->t) {
+    return luaL_error(L, "ticket is already consumed");
+  }
   int32_t rlen = 0;
   void *r = NULL;
-  int const err = bridge_call(exe_path, buf, (int32_t)buflen, NULL, &r, &rlen);
+  bool unchanged = false;
+  int const err = bridge_wait(lt->t, &r, &rlen, &unchanged);
+  lt->t = NULL;
+  // The executable stays on the stack for the statistics.
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lt->exe_ref);
+  char const *const exe_path = lua_tostring(L, -1);
+  if (err != ECALL_OK || unchanged) {
+    lua_ticket_release(L, lt);
+  }
   if (err != ECALL_OK) {
     return lua_bridge_call_error(L, err);
   }
+  if (lt->pixel_ref != LUA_NOREF) {
+    uint64_t const start = bridge_stats_begin();
+    lua_getglobal(L, "obj");
+    lua_getfield(L, -1, "putpixeldata");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lt->pixel_ref);
+    lua_ticket_release(L, lt);
+    lua_call(L, 1, 0);
+    lua_pop(L, 1);
+    bridge_stats_end(exe_path, BRIDGE_PHASE_PUTPIXELDATA, start);
+  }
+  uint64_t const start = bridge_stats_begin();
   lua_pushlstring(L, r, (size_t)rlen);
+  bridge_stats_end(exe_path, BRIDGE_PHASE_LUA_PUSH, start);
+  bridge_free_reply(r);
   return 1;
 }
 
-static uint64_t cyrb64(uint32_t const *const src, size_t const len, uint32_t const seed) {
-  uint32_t h1 = 0x91eb9dc7 ^ seed, h2 = 0x41c6ce57 ^ seed;
-  for (size_t i = 0; i < len; ++i) {
-    h1 = (h1 ^ src[i]) * 2654435761;
-    h2 = (h2 ^ src[i]) * 1597334677;
+static int lua_bridge_poll(lua_State *L) {
+  struct lua_ticket *const lt = luaL_checkudata(L, 1, TICKET_METATABLE);
+  if (!lt->t) {
+    return luaL_error(L, "ticket is already consumed");
   }
-  h1 = ((h1 ^ (h1 >> 16)) * 2246822507) ^ ((h2 ^ (h2 >> 13)) * 3266489909);
-  h2 = ((h2 ^ (h2 >> 16)) * 2246822507) ^ ((h1 ^ (h1 >> 13)) * 3266489909);
-  return (((uint64_t)h2) << 32) | ((uint64_t)h1);
+  lua_pushboolean(L, bridge_poll(lt->t));
+  return 1;
 }
 
 static inline void to_hex(char *const dst, uint64_t x) {
@@ -158,8 +632,11 @@ static int lua_bridge_calc_hash(lua_State *L) {
   if (w <= 0 || h <= 0) {
     return luaL_error(L, "invalid arguments");
   }
+  // Scripts that saved hashes of older versions pass true to get the values of the scalar cyrb64.
+  bool const legacy = lua_toboolean(L, 4);
+  size_t const len = (size_t)w * (size_t)h;
   char b[16];
-  to_hex(b, cyrb64(p, (size_t)(w * h), 0x3fc0b49e));
+  to_hex(b, legacy ? cyrb64(p, len, PIXEL_HASH_SEED) : cyrb64_wide(p, len, PIXEL_HASH_SEED));
   lua_pushlstring(L, b, 16);
   return 1;
 }
@@ -168,9 +645,34 @@ EXTERN_C int __declspec(dllexport) luaopen_bridge(lua_State *L);
 EXTERN_C int __declspec(dllexport) luaopen_bridge(lua_State *L) {
   static const struct luaL_Reg fntable[] = {
       {"call", lua_bridge_call},
+      {"call_batch", lua_bridge_call_batch},
+      {"call_async", lua_bridge_call_async},
+      {"wait", lua_bridge_wait},
+      {"poll", lua_bridge_poll},
+      {"pool", lua_bridge_pool},
+      {"sync", lua_bridge_sync},
+      {"doorbell", lua_bridge_doorbell},
+      {"wait_policy", lua_bridge_wait_policy},
+      {"channel", lua_bridge_channel},
+      {"preload", lua_bridge_preload},
+      {"ready", lua_bridge_ready},
+      {"cache_budget", lua_bridge_cache_budget},
+      {"cache_stats", lua_bridge_cache_stats},
+      {"buffer_stats", lua_bridge_buffer_stats},
+      {"wait_stats", lua_bridge_wait_stats},
+      {"stats", lua_bridge_stats},
+      {"stats_enable", lua_bridge_stats_enable},
+      {"stats_reset", lua_bridge_stats_reset},
+      {"trace_start", lua_bridge_trace_start},
+      {"trace_stop", lua_bridge_trace_stop},
       {"calc_hash", lua_bridge_calc_hash},
       {NULL, NULL},
   };
+  if (luaL_newmetatable(L, TICKET_METATABLE)) {
+    lua_pushcfunction(L, lua_ticket_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
   luaL_register(L, "bridge", fntable);
   return 1;
 }
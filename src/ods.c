@@ -1,16 +1,28 @@
 #include "ods.h"
 
 #include <stdarg.h>
-#include <windows.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <stdio.h>
+#endif
 
 void ODS(char const *const fmt, ...) {
-  char s[1024], f[1024];
   va_list p;
   va_start(p, fmt);
+#ifdef _WIN32
+  char s[1024], f[1024];
   f[0] = '\0';
   lstrcatA(f, "bridge: ");
   lstrcatA(f, fmt);
   wsprintfA(s, f, p);
   OutputDebugStringA(s);
+#else
+  // There is no debugger output, stderr is the closest.
+  fputs("bridge: ", stderr);
+  vfprintf(stderr, fmt, p);
+  fputc('\n', stderr);
+#endif
   va_end(p);
 }
@@ -0,0 +1,367 @@
+#include "pixfmt.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+// Every SIMD kernel below must produce exactly the same result as its scalar version,
+// so the floating point ones perform the same operations in the same order.
+
+static void premultiply_scalar(uint8_t *const dest, uint8_t const *const src, size_t const n) {
+  for (size_t i = 0; i < n * 4; i += 4) {
+    uint32_t const a = src[i + 3];
+    for (size_t c = 0; c < 3; ++c) {
+      uint32_t const t = src[i + c] * a + 128;
+      dest[i + c] = (uint8_t)((t + (t >> 8)) >> 8);
+    }
+    dest[i + 3] = (uint8_t)a;
+  }
+}
+
+static void unpremultiply_scalar(uint8_t *const dest, uint8_t const *const src, size_t const n) {
+  for (size_t i = 0; i < n * 4; i += 4) {
+    uint8_t const a = src[i + 3];
+    float const f = a ? 255.f / (float)a : 0.f;
+    for (size_t c = 0; c < 3; ++c) {
+      float const v = (float)src[i + c] * f;
+      dest[i + c] = (uint8_t)((v < 255.f ? v : 255.f) + .5f);
+    }
+    dest[i + 3] = a;
+  }
+}
+
+static void to_float_scalar(float *const dest, uint8_t const *const src, size_t const n) {
+  for (size_t i = 0; i < n * 4; ++i) {
+    dest[i] = (float)src[i] * (1.f / 255.f);
+  }
+}
+
+static void from_float_scalar(uint8_t *const dest, float const *const src, size_t const n) {
+  for (size_t i = 0; i < n * 4; ++i) {
+    float v = src[i] * 255.f;
+    v = v > 0.f ? v : 0.f;
+    v = v < 255.f ? v : 255.f;
+    dest[i] = (uint8_t)(v + .5f);
+  }
+}
+
+static void to_planar_scalar(uint8_t *const *const planes, uint8_t const *const src, size_t const n) {
+  for (size_t i = 0; i < n; ++i) {
+    planes[0][i] = src[i * 4 + 0];
+    planes[1][i] = src[i * 4 + 1];
+    planes[2][i] = src[i * 4 + 2];
+    planes[3][i] = src[i * 4 + 3];
+  }
+}
+
+static void from_planar_scalar(uint8_t *const dest, uint8_t const *const *const planes, size_t const n) {
+  for (size_t i = 0; i < n; ++i) {
+    dest[i * 4 + 0] = planes[0][i];
+    dest[i * 4 + 1] = planes[1][i];
+    dest[i * 4 + 2] = planes[2][i];
+    dest[i * 4 + 3] = planes[3][i];
+  }
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#  define PIXFMT_X86 1
+#  include <immintrin.h>
+
+__attribute__((target("sse2"))) static void
+premultiply_sse2(uint8_t *const dest, uint8_t const *const src, size_t const n) {
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+  __m128i const a255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+  __m128i const r128 = _mm_set1_epi16(128);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i const v = _mm_loadu_si128((void const *)(src + i * 4));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alo = _mm_or_si128(_mm_and_si128(alo, rgb), a255);
+    ahi = _mm_or_si128(_mm_and_si128(ahi, rgb), a255);
+    lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), r128);
+    hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), r128);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    _mm_storeu_si128((void *)(dest + i * 4), _mm_packus_epi16(lo, hi));
+  }
+  premultiply_scalar(dest + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+premultiply_avx2(uint8_t *const dest, uint8_t const *const src, size_t const n) {
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const rgb = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+  __m256i const a255 = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+  __m256i const r128 = _mm256_set1_epi16(128);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i const v = _mm256_loadu_si256((void const *)(src + i * 4));
+    // unpack and pack work within 128-bit lanes, so the pixel order survives the round trip.
+    __m256i lo = _mm256_unpacklo_epi8(v, zero);
+    __m256i hi = _mm256_unpackhi_epi8(v, zero);
+    __m256i alo =
+        _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i ahi =
+        _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    alo = _mm256_or_si256(_mm256_and_si256(alo, rgb), a255);
+    ahi = _mm256_or_si256(_mm256_and_si256(ahi, rgb), a255);
+    lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, alo), r128);
+    hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), r128);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+    _mm256_storeu_si256((void *)(dest + i * 4), _mm256_packus_epi16(lo, hi));
+  }
+  premultiply_sse2(dest + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static __m128i unpremultiply_pixel_sse2(__m128i const px) {
+  __m128 const v = _mm_cvtepi32_ps(px);
+  __m128 const a = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+  __m128 const f = _mm_and_ps(_mm_div_ps(_mm_set1_ps(255.f), a), _mm_cmpneq_ps(a, _mm_setzero_ps()));
+  __m128 const r = _mm_add_ps(_mm_min_ps(_mm_mul_ps(v, f), _mm_set1_ps(255.f)), _mm_set1_ps(.5f));
+  __m128i const alpha = _mm_set_epi32(-1, 0, 0, 0);
+  return _mm_or_si128(_mm_andnot_si128(alpha, _mm_cvttps_epi32(r)), _mm_and_si128(alpha, px));
+}
+
+__attribute__((target("sse2"))) static void
+unpremultiply_sse2(uint8_t *const dest, uint8_t const *const src, size_t const n) {
+  __m128i const zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i const v = _mm_loadu_si128((void const *)(src + i * 4));
+    __m128i const lo = _mm_unpacklo_epi8(v, zero);
+    __m128i const hi = _mm_unpackhi_epi8(v, zero);
+    __m128i const p0 = unpremultiply_pixel_sse2(_mm_unpacklo_epi16(lo, zero));
+    __m128i const p1 = unpremultiply_pixel_sse2(_mm_unpackhi_epi16(lo, zero));
+    __m128i const p2 = unpremultiply_pixel_sse2(_mm_unpacklo_epi16(hi, zero));
+    __m128i const p3 = unpremultiply_pixel_sse2(_mm_unpackhi_epi16(hi, zero));
+    __m128i const r = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+    _mm_storeu_si128((void *)(dest + i * 4), r);
+  }
+  unpremultiply_scalar(dest + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void to_float_sse2(float *const dest, uint8_t const *const src, size_t const n) {
+  __m128i const zero = _mm_setzero_si128();
+  __m128 const k = _mm_set1_ps(1.f / 255.f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i const v = _mm_loadu_si128((void const *)(src + i * 4));
+    __m128i const lo = _mm_unpacklo_epi8(v, zero);
+    __m128i const hi = _mm_unpackhi_epi8(v, zero);
+    float *const d = dest + i * 4;
+    _mm_storeu_ps(d + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), k));
+    _mm_storeu_ps(d + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), k));
+    _mm_storeu_ps(d + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), k));
+    _mm_storeu_ps(d + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), k));
+  }
+  to_float_scalar(dest + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2"))) static void to_float_avx2(float *const dest, uint8_t const *const src, size_t const n) {
+  __m256 const k = _mm256_set1_ps(1.f / 255.f);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m256i const v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((void const *)(src + i * 4)));
+    _mm256_storeu_ps(dest + i * 4, _mm256_mul_ps(_mm256_cvtepi32_ps(v), k));
+  }
+  to_float_scalar(dest + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static __m128i from_float_pixel_sse2(float const *const src) {
+  __m128 v = _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(255.f));
+  v = _mm_max_ps(v, _mm_setzero_ps());
+  v = _mm_min_ps(v, _mm_set1_ps(255.f));
+  return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(.5f)));
+}
+
+__attribute__((target("sse2"))) static void
+from_float_sse2(uint8_t *const dest, float const *const src, size_t const n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float const *const s = src + i * 4;
+    __m128i const lo = _mm_packs_epi32(from_float_pixel_sse2(s + 0), from_float_pixel_sse2(s + 4));
+    __m128i const hi = _mm_packs_epi32(from_float_pixel_sse2(s + 8), from_float_pixel_sse2(s + 12));
+    _mm_storeu_si128((void *)(dest + i * 4), _mm_packus_epi16(lo, hi));
+  }
+  from_float_scalar(dest + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+to_planar_sse2(uint8_t *const *const planes, uint8_t const *const src, size_t const n) {
+  __m128i const mask = _mm_set1_epi32(0xff);
+  __m128i const shifts[4] = {_mm_cvtsi32_si128(0), _mm_cvtsi32_si128(8), _mm_cvtsi32_si128(16), _mm_cvtsi32_si128(24)};
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v[4];
+    for (int j = 0; j < 4; ++j) {
+      v[j] = _mm_loadu_si128((void const *)(src + (i + (size_t)j * 4) * 4));
+    }
+    for (int c = 0; c < 4; ++c) {
+      __m128i const c0 = _mm_and_si128(_mm_srl_epi32(v[0], shifts[c]), mask);
+      __m128i const c1 = _mm_and_si128(_mm_srl_epi32(v[1], shifts[c]), mask);
+      __m128i const c2 = _mm_and_si128(_mm_srl_epi32(v[2], shifts[c]), mask);
+      __m128i const c3 = _mm_and_si128(_mm_srl_epi32(v[3], shifts[c]), mask);
+      __m128i const r = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+      _mm_storeu_si128((void *)(planes[c] + i), r);
+    }
+  }
+  uint8_t *const rest[4] = {planes[0] + i, planes[1] + i, planes[2] + i, planes[3] + i};
+  to_planar_scalar(rest, src + i * 4, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+from_planar_sse2(uint8_t *const dest, uint8_t const *const *const planes, size_t const n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i const b = _mm_loadu_si128((void const *)(planes[0] + i));
+    __m128i const g = _mm_loadu_si128((void const *)(planes[1] + i));
+    __m128i const r = _mm_loadu_si128((void const *)(planes[2] + i));
+    __m128i const a = _mm_loadu_si128((void const *)(planes[3] + i));
+    __m128i const bglo = _mm_unpacklo_epi8(b, g), bghi = _mm_unpackhi_epi8(b, g);
+    __m128i const ralo = _mm_unpacklo_epi8(r, a), rahi = _mm_unpackhi_epi8(r, a);
+    uint8_t *const d = dest + i * 4;
+    _mm_storeu_si128((void *)(d + 0), _mm_unpacklo_epi16(bglo, ralo));
+    _mm_storeu_si128((void *)(d + 16), _mm_unpackhi_epi16(bglo, ralo));
+    _mm_storeu_si128((void *)(d + 32), _mm_unpacklo_epi16(bghi, rahi));
+    _mm_storeu_si128((void *)(d + 48), _mm_unpackhi_epi16(bghi, rahi));
+  }
+  uint8_t const *const rest[4] = {planes[0] + i, planes[1] + i, planes[2] + i, planes[3] + i};
+  from_planar_scalar(dest + i * 4, rest, n - i);
+}
+#endif
+
+struct kernels {
+  void (*premultiply)(uint8_t *const dest, uint8_t const *const src, size_t const n);
+  void (*unpremultiply)(uint8_t *const dest, uint8_t const *const src, size_t const n);
+  void (*to_float)(float *const dest, uint8_t const *const src, size_t const n);
+  void (*from_float)(uint8_t *const dest, float const *const src, size_t const n);
+  void (*to_planar)(uint8_t *const *const planes, uint8_t const *const src, size_t const n);
+  void (*from_planar)(uint8_t *const dest, uint8_t const *const *const planes, size_t const n);
+};
+
+static struct kernels const *get_kernels(void) {
+  static struct kernels const scalar = {
+      premultiply_scalar,
+      unpremultiply_scalar,
+      to_float_scalar,
+      from_float_scalar,
+      to_planar_scalar,
+      from_planar_scalar,
+  };
+#ifdef PIXFMT_X86
+  static struct kernels const sse2 = {
+      premultiply_sse2,
+      unpremultiply_sse2,
+      to_float_sse2,
+      from_float_sse2,
+      to_planar_sse2,
+      from_planar_sse2,
+  };
+  static struct kernels const avx2 = {
+      premultiply_avx2,
+      unpremultiply_sse2,
+      to_float_avx2,
+      from_float_sse2,
+      to_planar_sse2,
+      from_planar_sse2,
+  };
+  // Detection is idempotent, racing threads just store the same value.
+  // The tables are constant, so relaxed ordering is enough.
+  static _Atomic(struct kernels const *) cached = NULL;
+  struct kernels const *k = atomic_load_explicit(&cached, memory_order_relaxed);
+  if (!k) {
+    __builtin_cpu_init();
+    k = __builtin_cpu_supports("avx2") ? &avx2 : __builtin_cpu_supports("sse2") ? &sse2 : &scalar;
+    atomic_store_explicit(&cached, k, memory_order_relaxed);
+  }
+  return k;
+#else
+  return &scalar;
+#endif
+}
+
+size_t pixfmt_size(enum pixel_format const format, size_t const width, size_t const height) {
+  return width * height * (format == PIXEL_FORMAT_FLOAT ? 4 * sizeof(float) : 4);
+}
+
+void pixfmt_encode(enum pixel_format const format,
+                   void *const body,
+                   void const *const src,
+                   size_t const width,
+                   size_t const height,
+                   size_t const x,
+                   size_t const y,
+                   size_t const rw,
+                   size_t const rh) {
+  struct kernels const *const k = get_kernels();
+  uint8_t *const d = body;
+  uint8_t const *const s = src;
+  for (size_t row = y; row < y + rh; ++row) {
+    size_t const offset = row * width + x;
+    switch (format) {
+    case PIXEL_FORMAT_BGRA:
+      memcpy(d + offset * 4, s + offset * 4, rw * 4);
+      break;
+    case PIXEL_FORMAT_PREMULTIPLIED:
+      k->premultiply(d + offset * 4, s + offset * 4, rw);
+      break;
+    case PIXEL_FORMAT_PLANAR: {
+      size_t const plane = width * height;
+      uint8_t *const planes[4] = {
+          d + offset,
+          d + plane + offset,
+          d + plane * 2 + offset,
+          d + plane * 3 + offset,
+      };
+      k->to_planar(planes, s + offset * 4, rw);
+      break;
+    }
+    case PIXEL_FORMAT_FLOAT:
+      k->to_float((float *)(void *)(d + offset * 4 * sizeof(float)), s + offset * 4, rw);
+      break;
+    }
+  }
+}
+
+void pixfmt_decode(enum pixel_format const format,
+                   void *const dest,
+                   void const *const body,
+                   size_t const width,
+                   size_t const height,
+                   size_t const x,
+                   size_t const y,
+                   size_t const rw,
+                   size_t const rh) {
+  struct kernels const *const k = get_kernels();
+  uint8_t *const d = dest;
+  uint8_t const *const s = body;
+  for (size_t row = y; row < y + rh; ++row) {
+    size_t const offset = row * width + x;
+    switch (format) {
+    case PIXEL_FORMAT_BGRA:
+      memcpy(d + offset * 4, s + offset * 4, rw * 4);
+      break;
+    case PIXEL_FORMAT_PREMULTIPLIED:
+      k->unpremultiply(d + offset * 4, s + offset * 4, rw);
+      break;
+    case PIXEL_FORMAT_PLANAR: {
+      size_t const plane = width * height;
+      uint8_t const *const planes[4] = {
+          s + offset,
+          s + plane + offset,
+          s + plane * 2 + offset,
+          s + plane * 3 + offset,
+      };
+      k->from_planar(d + offset * 4, planes, rw);
+      break;
+    }
+    case PIXEL_FORMAT_FLOAT:
+      k->from_float(d + offset * 4, (float const *)(void const *)(s + offset * 4 * sizeof(float)), rw);
+      break;
+    }
+  }
+}
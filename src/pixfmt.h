@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bridge.h"
+
+// Returns the number of bytes a width x height image takes in format.
+size_t pixfmt_size(enum pixel_format const format, size_t const width, size_t const height);
+// Converts the rw x rh rectangle at (x, y) of the straight BGRA8 image src into body, which holds format.
+// Both images are width x height pixels.
+void pixfmt_encode(enum pixel_format const format,
+                   void *const body,
+                   void const *const src,
+                   size_t const width,
+                   size_t const height,
+                   size_t const x,
+                   size_t const y,
+                   size_t const rw,
+                   size_t const rh);
+// The reverse of pixfmt_encode.
+void pixfmt_decode(enum pixel_format const format,
+                   void *const dest,
+                   void const *const body,
+                   size_t const width,
+                   size_t const height,
+                   size_t const x,
+                   size_t const y,
+                   size_t const rw,
+                   size_t const rh);
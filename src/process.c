@@ -2,125 +2,265 @@
 
 #include "threads.h"
 
+#include "channel.h"
+#include "doorbell.h"
+#include "queue.h"
+#include "spin.h"
+#include "timer.h"
+
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
-#include <windows.h>
 
-struct queue {
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <signal.h>
+#  include <spawn.h>
+#  include <stdio.h>
+#  include <sys/socket.h>
+#  include <sys/wait.h>
+#  include <time.h>
+#  include <unistd.h>
+extern char **environ;
+#endif
+
+// How often a doorbell process checks whether the child is still alive while waiting for a reply.
+#define DOORBELL_POLL_MS 50
+
+#ifdef _WIN32
+typedef HANDLE pipe_t;
+#  define INVALID_PIPE INVALID_HANDLE_VALUE
+#else
+typedef int pipe_t;
+#  define INVALID_PIPE (-1)
+// How long process_finish lets a child exit on its own after closing its stdin before it kills it.
+#  define EXIT_GRACE_MS 1000
+#  ifndef MSG_NOSIGNAL
+#    define MSG_NOSIGNAL 0
+#  endif
+#endif
+
+#define POOL_MAX_SPARES 4
+#define POOL_MIN_CAP 4096
+// Number of replies after which spare buffers larger than recent replies need are released.
+#define POOL_SHRINK_PERIOD 64
+
+// Reply buffers come from here so that their memory can be reused.
+// It is shared by the process and the buffers it handed out, whichever is released last destroys it.
+struct buffer_pool {
   mtx_t mtx;
-  cnd_t cnd, cnd2;
-  void **items;
-  int num_items, used;
-  int readcur, writecur;
+  struct queue_item *spares[POOL_MAX_SPARES];
+  int num_spares;
+  int refs;
+  size_t pooled_bytes;
+  size_t in_use_bytes;
+  // Largest reply in the current and the previous period.
+  size_t peak;
+  size_t prev_peak;
+  int period_replies;
+  bool closed;
+  uint8_t padding[3];
+};
+
+struct queue_item {
+  void *buf;
+  int32_t len;
+  size_t cap;
+  // NULL if the item does not belong to a pool.
+  struct buffer_pool *pool;
+  // When read_worker received it, 0 if unknown.
+  uint64_t arrived;
 };
 
-static struct queue *queue_init(void **items, int num_items) {
-  int mtx_ret = thrd_error;
-  int cnd_ret = thrd_error;
-  int cnd2_ret = thrd_error;
-  struct queue *const q = malloc(sizeof(struct queue));
-  if (!q) {
+struct process {
+  // Decides how process_read waits for read_worker or the doorbell.
+  struct spinner spinner;
+#ifdef _WIN32
+  HANDLE process;
+#else
+  pid_t pid;
+#endif
+  // Used by both read_worker and process_read.
+  struct buffer_pool *pool;
+  // NULL if replies always come through the pipe.
+  struct channel *channel;
+  // Not NULL if requests and replies are announced through the shared memory instead of the pipes.
+  struct doorbell *doorbell;
+  thrd_t thread;
+  struct queue *q;
+  struct queue_item *exit_item;
+  // The reply being read. A synchronous process reads it piece by piece in process_readable
+  // because the child cannot finish writing a reply larger than the pipe buffer until it is read.
+  int32_t reply_head[3];
+  size_t reply_head_got;
+  struct queue_item *reply;
+  size_t reply_got;
+  // A reply of a synchronous process that process_readable has read completely.
+  struct queue_item *ready;
+  pipe_t in_w;
+  pipe_t out_r;
+  pipe_t err_r;
+  // Valid while has_request_end is set, which means a payload written by process_write occupies the channel.
+  uint32_t request_end;
+  bool has_request_end;
+  // Synchronous processes have no read_worker, process_read reads the pipe on the calling thread.
+  bool sync;
+  // Set once no more replies can arrive.
+  bool worker_exited;
+  uint8_t padding[5];
+};
+
+static struct buffer_pool *buffer_pool_create(void) {
+  struct buffer_pool *const pool = calloc(1, sizeof(struct buffer_pool));
+  if (!pool) {
     return NULL;
   }
-  q->items = items;
-  q->num_items = num_items;
-  q->used = 0;
-  q->readcur = 0;
-  q->writecur = 0;
-  mtx_ret = mtx_init(&q->mtx, mtx_plain | mtx_recursive);
-  if (mtx_ret != thrd_success) {
-    goto cleanup;
-  }
-  cnd_ret = cnd_init(&q->cnd);
-  if (cnd_ret != thrd_success) {
-    goto cleanup;
-  }
-  cnd2_ret = cnd_init(&q->cnd2);
-  if (cnd2_ret != thrd_success) {
-    goto cleanup;
-  }
-  return q;
-cleanup:
-  if (cnd2_ret == thrd_success) {
-    cnd_destroy(&q->cnd2);
+  if (mtx_init(&pool->mtx, mtx_plain) != thrd_success) {
+    free(pool);
+    return NULL;
   }
-  if (cnd_ret == thrd_success) {
-    cnd_destroy(&q->cnd);
+  pool->refs = 1;
+  return pool;
+}
+
+static void buffer_pool_release(struct buffer_pool *const pool) {
+  mtx_lock(&pool->mtx);
+  bool const last = --pool->refs == 0;
+  mtx_unlock(&pool->mtx);
+  if (last) {
+    for (int i = 0; i < pool->num_spares; ++i) {
+      free(pool->spares[i]);
+    }
+    mtx_destroy(&pool->mtx);
+    free(pool);
   }
-  if (mtx_ret == thrd_success) {
-    mtx_destroy(&q->mtx);
+}
+
+static size_t round_cap(size_t const len) {
+  size_t cap = POOL_MIN_CAP;
+  while (cap < len) {
+    cap *= 2;
   }
-  free(q);
-  return NULL;
+  return cap;
 }
 
-static void queue_destroy(struct queue *const q) {
-  cnd_destroy(&q->cnd2);
-  cnd_destroy(&q->cnd);
-  mtx_destroy(&q->mtx);
-  free(q);
+// pool->mtx must be held.
+static size_t buffer_pool_cap_limit(struct buffer_pool const *const pool) {
+  return round_cap(pool->peak > pool->prev_peak ? pool->peak : pool->prev_peak);
 }
 
-static void queue_push(struct queue *const q, void *item) {
-  mtx_lock(&q->mtx);
-  while (q->used == q->num_items) {
-    cnd_wait(&q->cnd2, &q->mtx);
+// pool->mtx must be held.
+static void buffer_pool_remove_spare(struct buffer_pool *const pool, int const i) {
+  pool->pooled_bytes -= pool->spares[i]->cap;
+  pool->spares[i] = pool->spares[--pool->num_spares];
+}
+
+static struct queue_item *buffer_pool_get(struct buffer_pool *const pool, size_t const len) {
+  struct queue_item *qi = NULL;
+  mtx_lock(&pool->mtx);
+  if (len > pool->peak) {
+    pool->peak = len;
+  }
+  if (++pool->period_replies == POOL_SHRINK_PERIOD) {
+    pool->prev_peak = pool->peak;
+    pool->peak = 0;
+    pool->period_replies = 0;
+    size_t const limit = buffer_pool_cap_limit(pool);
+    for (int i = pool->num_spares - 1; i >= 0; --i) {
+      if (pool->spares[i]->cap > limit) {
+        struct queue_item *const garbage = pool->spares[i];
+        buffer_pool_remove_spare(pool, i);
+        free(garbage);
+      }
+    }
+  }
+  int best = -1;
+  for (int i = 0; i < pool->num_spares; ++i) {
+    if (pool->spares[i]->cap >= len && (best == -1 || pool->spares[i]->cap < pool->spares[best]->cap)) {
+      best = i;
+    }
   }
-  q->items[q->writecur] = item;
-  ++q->used;
-  q->writecur = (q->writecur + 1) % q->num_items;
-  cnd_signal(&q->cnd);
-  mtx_unlock(&q->mtx);
+  if (best != -1) {
+    qi = pool->spares[best];
+    buffer_pool_remove_spare(pool, best);
+  }
+  mtx_unlock(&pool->mtx);
+  if (!qi) {
+    // Capacities grow geometrically so that slowly growing replies keep fitting in the same buffer.
+    size_t const cap = round_cap(len);
+    qi = malloc(sizeof(struct queue_item) + cap);
+    if (!qi) {
+      return NULL;
+    }
+    qi->cap = cap;
+    qi->pool = pool;
+  }
+  mtx_lock(&pool->mtx);
+  ++pool->refs;
+  pool->in_use_bytes += qi->cap;
+  mtx_unlock(&pool->mtx);
+  qi->len = (int32_t)len;
+  qi->buf = qi + 1;
+  return qi;
 }
 
-static void *queue_pop(struct queue *const q) {
-  void *r = NULL;
-  mtx_lock(&q->mtx);
-  while (q->used == 0) {
-    cnd_wait(&q->cnd, &q->mtx);
+static void buffer_pool_put(struct queue_item *const qi) {
+  struct buffer_pool *const pool = qi->pool;
+  struct queue_item *garbage = qi;
+  mtx_lock(&pool->mtx);
+  pool->in_use_bytes -= qi->cap;
+  if (!pool->closed && qi->cap <= buffer_pool_cap_limit(pool)) {
+    if (pool->num_spares == POOL_MAX_SPARES) {
+      // Replace the smallest spare if this one is larger.
+      int smallest = 0;
+      for (int i = 1; i < pool->num_spares; ++i) {
+        if (pool->spares[i]->cap < pool->spares[smallest]->cap) {
+          smallest = i;
+        }
+      }
+      if (pool->spares[smallest]->cap < qi->cap) {
+        garbage = pool->spares[smallest];
+        buffer_pool_remove_spare(pool, smallest);
+      }
+    }
+    if (pool->num_spares < POOL_MAX_SPARES) {
+      if (garbage == qi) {
+        garbage = NULL;
+      }
+      pool->spares[pool->num_spares++] = qi;
+      pool->pooled_bytes += qi->cap;
+    }
   }
-  r = q->items[q->readcur];
-  q->items[q->readcur] = NULL;
-  --q->used;
-  q->readcur = (q->readcur + 1) % q->num_items;
-  cnd_signal(&q->cnd2);
-  mtx_unlock(&q->mtx);
-  return r;
+  mtx_unlock(&pool->mtx);
+  free(garbage);
+  buffer_pool_release(pool);
 }
 
-#if 0
-static void *queue_pop_nowait(struct queue *const q)
-{
-  void *r = NULL;
-  mtx_lock(&q->mtx);
-  if (q->used > 0)
-  {
-    r = q->items[q->readcur];
-    q->items[q->readcur] = NULL;
-    --q->used;
-    q->readcur = (q->readcur + 1) % q->num_items;
-    cnd_signal(&q->cnd2);
-  }
-  mtx_unlock(&q->mtx);
-  return r;
+static void buffer_pool_close(struct buffer_pool *const pool) {
+  mtx_lock(&pool->mtx);
+  pool->closed = true;
+  while (pool->num_spares > 0) {
+    struct queue_item *const garbage = pool->spares[pool->num_spares - 1];
+    buffer_pool_remove_spare(pool, pool->num_spares - 1);
+    free(garbage);
+  }
+  mtx_unlock(&pool->mtx);
+  buffer_pool_release(pool);
 }
-#endif
 
-struct queue_item {
-  void *buf;
-  int32_t len;
-};
+static void queue_item_free(struct queue_item *const qi) {
+  if (qi->pool) {
+    buffer_pool_put(qi);
+  } else {
+    free(qi);
+  }
+}
 
-struct process {
-  HANDLE process;
-  thrd_t thread;
-  struct queue *q;
-  struct queue_item *queue_items[2];
-  void *previous_queue_item;
-  HANDLE in_w;
-  HANDLE out_r;
-  HANDLE err_r;
-};
+#ifdef _WIN32
 
 static wchar_t *build_environment_strings(wchar_t const *const name, wchar_t const *const value) {
   LPWCH envstr = GetEnvironmentStringsW();
@@ -195,77 +335,342 @@ static WCHAR *get_working_directory(const WCHAR *exe_path) {
   return dir;
 }
 
-static BOOL read(HANDLE h, void *buf, DWORD sz) {
+static bool read_all(HANDLE h, void *buf, size_t const size) {
   char *b = buf;
+  DWORD sz = (DWORD)size;
   for (DWORD read; sz > 0; b += read, sz -= read) {
     if (!ReadFile(h, b, sz, &read, NULL)) {
-      return FALSE;
+      return false;
     }
   }
-  return TRUE;
+  return true;
 }
 
-static BOOL write(HANDLE h, const void *buf, DWORD sz) {
+// Returns the number of bytes read without blocking, -1 if the pipe is broken.
+static int read_nowait(HANDLE h, void *buf, size_t const size) {
+  DWORD avail = 0;
+  if (!PeekNamedPipe(h, NULL, 0, NULL, &avail, NULL)) {
+    return -1;
+  }
+  if (avail == 0) {
+    return 0;
+  }
+  DWORD read = 0;
+  DWORD const want = size < avail ? (DWORD)size : avail;
+  if (!ReadFile(h, buf, want, &read, NULL)) {
+    return -1;
+  }
+  return (int)read;
+}
+
+static bool write_all(HANDLE h, const void *buf, size_t const size) {
   const char *b = buf;
+  DWORD sz = (DWORD)size;
   for (DWORD written; sz > 0; b += written, sz -= written) {
     if (!WriteFile(h, b, sz, &written, NULL)) {
-      return FALSE;
+      return false;
     }
   }
-  return TRUE;
+  return true;
+}
+
+#else
+
+static bool read_all(int const fd, void *buf, size_t sz) {
+  char *b = buf;
+  while (sz > 0) {
+    ssize_t const n = read(fd, b, sz);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    b += n;
+    sz -= (size_t)n;
+  }
+  return true;
+}
+
+// Returns the number of bytes read without blocking, -1 if the socket is closed or broken.
+static int read_nowait(int const fd, void *buf, size_t const size) {
+  for (;;) {
+    ssize_t const n = recv(fd, buf, size > INT32_MAX ? INT32_MAX : size, MSG_DONTWAIT);
+    if (n > 0) {
+      return (int)n;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+}
+
+// stdin of the child is a socket so that a child that has exited makes this fail instead of raising SIGPIPE.
+static bool write_all(int const fd, void const *buf, size_t sz) {
+  char const *b = buf;
+  while (sz > 0) {
+    ssize_t const n = send(fd, b, sz, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    b += n;
+    sz -= (size_t)n;
+  }
+  return true;
+}
+
+#endif
+
+enum read_state {
+  READ_DONE,
+  READ_PENDING,
+  READ_FAILED,
+};
+
+// Reads buf up to size, *got bytes of which were read before.
+// Without block, it returns READ_PENDING as soon as nothing more is available.
+static enum read_state read_part(struct process *const self,
+                                 void *const buf,
+                                 size_t const size,
+                                 size_t *const got,
+                                 bool const block) {
+  char *const b = buf;
+  if (block) {
+    if (*got < size && !read_all(self->out_r, b + *got, size - *got)) {
+      return READ_FAILED;
+    }
+    *got = size;
+    return READ_DONE;
+  }
+  while (*got < size) {
+    int const n = read_nowait(self->out_r, b + *got, size - *got);
+    if (n < 0) {
+      return READ_FAILED;
+    }
+    if (n == 0) {
+      return READ_PENDING;
+    }
+    *got += (size_t)n;
+  }
+  return READ_DONE;
+}
+
+// Reads one framed reply or continues the one read before, the stream cannot be used anymore if this fails.
+static enum read_state read_reply(struct process *const self, bool const block, struct queue_item **const r) {
+  enum read_state st = read_part(self, self->reply_head, sizeof(int32_t), &self->reply_head_got, block);
+  if (st != READ_DONE) {
+    return st;
+  }
+  int32_t const sz = self->reply_head[0];
+  if (sz == SHARE_MEM_CHANNEL_FRAME && self->channel) {
+    st = read_part(self, self->reply_head, sizeof(self->reply_head), &self->reply_head_got, block);
+    if (st != READ_DONE) {
+      return st;
+    }
+    uint32_t ref[2];
+    memcpy(ref, self->reply_head + 1, sizeof(ref));
+    struct queue_item *const qi = buffer_pool_get(self->pool, ref[1]);
+    if (!qi) {
+      return READ_FAILED;
+    }
+    if (!channel_get(self->channel, ref[0], ref[1], qi->buf)) {
+      buffer_pool_put(qi);
+      return READ_FAILED;
+    }
+    self->reply_head_got = 0;
+    *r = qi;
+    return READ_DONE;
+  }
+  if (sz < 0) {
+    return READ_FAILED;
+  }
+  if (!self->reply) {
+    self->reply = buffer_pool_get(self->pool, (size_t)sz);
+    if (!self->reply) {
+      return READ_FAILED;
+    }
+    self->reply_got = 0;
+  }
+  st = read_part(self, self->reply->buf, (size_t)sz, &self->reply_got, block);
+  if (st != READ_DONE) {
+    return st;
+  }
+  *r = self->reply;
+  self->reply = NULL;
+  self->reply_head_got = 0;
+  return READ_DONE;
 }
 
 static int read_worker(void *userdata) {
   struct process *self = userdata;
   while (1) {
-    int32_t sz;
-    if (!read(self->out_r, &sz, sizeof(sz))) {
+    struct queue_item *qi = NULL;
+    if (read_reply(self, true, &qi) != READ_DONE) {
       goto error;
     }
-    struct queue_item *qi = malloc(sizeof(struct queue_item) + (size_t)sz);
-    qi->len = sz;
-    if (sz) {
-      qi->buf = qi + 1;
-      if (!read(self->out_r, qi->buf, (DWORD)sz)) {
-        free(qi);
-        goto error;
-      }
-    } else {
-      qi->buf = NULL;
+    qi->arrived = timer_now_ns();
+    if (!queue_push(self->q, qi)) {
+      buffer_pool_put(qi);
+      goto error;
     }
-    queue_push(self->q, qi);
   }
 
-error : {
-  struct queue_item *qi = malloc(sizeof(struct queue_item));
-  qi->buf = NULL;
-  qi->len = -1;
-  queue_push(self->q, qi);
-}
+error:;
+  // Preallocated in process_start so that the consumer is always woken up.
+  // self may be freed as soon as it is pushed, so do not touch it afterwards.
+  // The queue is kept alive by our reference until queue_push has returned.
+  struct queue_item *const exit_item = self->exit_item;
+  struct queue *const q = self->q;
+  self->exit_item = NULL;
+  queue_push(q, exit_item);
+  queue_release(q);
   return 1;
 }
 
 int process_write(struct process *const self, void const *const buf, size_t const len) {
+  if (self->doorbell) {
+    uint32_t offset;
+    if (!channel_put(self->channel, buf, len, &offset, &self->request_end)) {
+      return 2;
+    }
+    self->has_request_end = true;
+    doorbell_ring_request(self->doorbell, offset, (uint32_t)len);
+    return 0;
+  }
   int32_t sz = (int32_t)len;
-  if (!write(self->in_w, &sz, sizeof(sz))) {
+  if (!write_all(self->in_w, &sz, sizeof(sz))) {
     return 1;
   }
-  if (!write(self->in_w, buf, len)) {
+  if (!write_all(self->in_w, buf, len)) {
     return 3;
   }
   return 0;
 }
 
+int process_write_ref(struct process *const self, uint32_t const offset, uint32_t const size) {
+  if (self->doorbell) {
+    doorbell_ring_request(self->doorbell, offset, size);
+    return 0;
+  }
+  struct {
+    int32_t sz;
+    uint32_t offset;
+    uint32_t size;
+  } const frame = {SHARE_MEM_CHANNEL_FRAME, offset, size};
+  return write_all(self->in_w, &frame, sizeof(frame)) ? 0 : 1;
+}
+
+int process_write_batch(struct process *const self,
+                        void const *const *const bufs,
+                        size_t const *const lens,
+                        size_t const n) {
+  if (self->doorbell) {
+    // There is only one request slot.
+    return 1;
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += sizeof(int32_t) + lens[i];
+  }
+  char *const b = malloc(total);
+  if (!b) {
+    return 2;
+  }
+  char *p = b;
+  for (size_t i = 0; i < n; ++i) {
+    int32_t const sz = (int32_t)lens[i];
+    memcpy(p, &sz, sizeof(sz));
+    p += sizeof(sz);
+    memcpy(p, bufs[i], lens[i]);
+    p += lens[i];
+  }
+  bool const ok = write_all(self->in_w, b, total);
+  free(b);
+  return ok ? 0 : 3;
+}
+
+static int read_sync(struct process *const self, void **const buf, size_t *const len) {
+  struct queue_item *qi = self->ready;
+  self->ready = NULL;
+  if (!qi && read_reply(self, true, &qi) != READ_DONE) {
+    self->worker_exited = true;
+    return 2;
+  }
+  *buf = qi->buf;
+  *len = (size_t)qi->len;
+  return 0;
+}
+
+static bool doorbell_ready(void *userdata) { return doorbell_reply_ready(userdata); }
+
+static bool queue_ready(void *userdata) { return !queue_empty(userdata); }
+
+static struct queue_item *read_doorbell(struct process *const self) {
+  uint64_t start;
+  if (!spinner_spin(&self->spinner, doorbell_ready, self->doorbell, &start)) {
+    while (!doorbell_wait_reply(self->doorbell, DOORBELL_POLL_MS)) {
+      // The child may have replied right before exiting.
+      if (!process_isrunning(self) && !doorbell_reply_ready(self->doorbell)) {
+        return NULL;
+      }
+    }
+    spinner_woke(&self->spinner, start, 0);
+  }
+  if (self->has_request_end) {
+    channel_release(self->channel, self->request_end);
+    self->has_request_end = false;
+  }
+  uint32_t offset, size;
+  doorbell_get_reply(self->doorbell, &offset, &size);
+  struct queue_item *const qi = buffer_pool_get(self->pool, size);
+  if (!qi) {
+    return NULL;
+  }
+  if (!channel_get(self->channel, offset, size, qi->buf)) {
+    buffer_pool_put(qi);
+    return NULL;
+  }
+  return qi;
+}
+
 int process_read(struct process *const self, void **const buf, size_t *const len) {
-  struct queue_item *qi = queue_pop(self->q);
+  if (self->worker_exited) {
+    return 2;
+  }
+  if (self->doorbell) {
+    struct queue_item *const qi = read_doorbell(self);
+    if (!qi) {
+      self->worker_exited = true;
+      return 2;
+    }
+    *buf = qi->buf;
+    *len = (size_t)qi->len;
+    return 0;
+  }
+  if (self->sync) {
+    return read_sync(self, buf, len);
+  }
+  uint64_t start;
+  struct queue_item *qi = NULL;
+  if (spinner_spin(&self->spinner, queue_ready, self->q, &start)) {
+    qi = queue_pop_nowait(self->q);
+  } else {
+    qi = queue_pop(self->q);
+    if (qi) {
+      spinner_woke(&self->spinner, start, qi->arrived);
+    }
+  }
   if (!qi) {
     return 1;
   }
-  if (self->previous_queue_item) {
-    free(self->previous_queue_item);
-  }
-  self->previous_queue_item = qi;
   if (qi->buf == NULL && qi->len == -1) {
+    // read_worker pushes this only once right before it exits.
+    self->worker_exited = true;
+    free(qi);
     return 2;
   }
   *buf = qi->buf;
@@ -273,8 +678,135 @@ int process_read(struct process *const self, void **const buf, size_t *const len
   return 0;
 }
 
-struct process *
-process_start(wchar_t const *const exe_path, wchar_t const *const envvar_name, wchar_t const *const envvar_value) {
+void *process_alloc_buffer(size_t const len) {
+  struct queue_item *qi = malloc(sizeof(struct queue_item) + len);
+  if (!qi) {
+    return NULL;
+  }
+  qi->len = (int32_t)len;
+  qi->buf = qi + 1;
+  qi->cap = len;
+  qi->pool = NULL;
+  qi->arrived = 0;
+  return qi->buf;
+}
+
+void process_free_buffer(void *const buf) {
+  if (buf) {
+    queue_item_free((struct queue_item *)buf - 1);
+  }
+}
+
+void process_get_buffer_stats(struct process *const self, struct process_buffer_stats *const stats) {
+  mtx_lock(&self->pool->mtx);
+  stats->pooled = self->pool->pooled_bytes;
+  stats->in_use = self->pool->in_use_bytes;
+  mtx_unlock(&self->pool->mtx);
+}
+
+// Allocates everything but the child, which the caller attaches before process_begin.
+static struct process *process_alloc(bool const sync, struct channel *const channel, struct doorbell *const doorbell) {
+  struct process *r = calloc(1, sizeof(struct process));
+  if (!r) {
+    return NULL;
+  }
+  r->in_w = INVALID_PIPE;
+  r->out_r = INVALID_PIPE;
+  r->err_r = INVALID_PIPE;
+  // Nothing arrives through the pipe with the doorbell, so there is nothing for read_worker to do.
+  r->sync = sync || doorbell;
+  r->channel = channel;
+  r->doorbell = doorbell;
+  spinner_init(&r->spinner, WAIT_POLICY_ADAPTIVE, BRIDGE_DEFAULT_SPINS);
+
+  r->pool = buffer_pool_create();
+  if (!r->pool) {
+    free(r);
+    return NULL;
+  }
+  if (r->sync) {
+    return r;
+  }
+
+  r->exit_item = malloc(sizeof(struct queue_item));
+  if (!r->exit_item) {
+    buffer_pool_close(r->pool);
+    free(r);
+    return NULL;
+  }
+  r->exit_item->buf = NULL;
+  r->exit_item->len = -1;
+  r->exit_item->cap = 0;
+  r->exit_item->pool = NULL;
+  r->exit_item->arrived = 0;
+  r->q = queue_init();
+  if (!r->q) {
+    free(r->exit_item);
+    buffer_pool_close(r->pool);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+// Frees what process_alloc allocated, the child and the pipes are left to the caller.
+static void process_free(struct process *const self) {
+  if (self->q) {
+    queue_release(self->q);
+  }
+  free(self->exit_item);
+  if (self->reply) {
+    buffer_pool_put(self->reply);
+  }
+  if (self->ready) {
+    buffer_pool_put(self->ready);
+  }
+  buffer_pool_close(self->pool);
+  free(self);
+}
+
+// Starts read_worker once the pipes are attached.
+static bool process_begin(struct process *const self) {
+  if (self->sync) {
+    return true;
+  }
+  // The reference of read_worker, see queue_release.
+  queue_retain(self->q);
+  if (thrd_create(&self->thread, read_worker, self) != thrd_success) {
+    queue_release(self->q);
+    return false;
+  }
+  return true;
+}
+
+// Waits for read_worker to give up after the pipe from the child has been broken and discards the replies.
+static void drain(struct process *const self) {
+  // FIXME: we cannot use thrd_join on DLL_PROCESS_DETACH bacause hangs.
+  // thrd_join(self->thread, NULL);
+  // struct queue_item *qi = NULL;
+  // while ((qi = queue_pop_nowait(self->q)))
+  // {
+  //   free(qi);
+  // }
+  thrd_detach(self->thread);
+  struct queue_item *qi = NULL;
+  while (!self->worker_exited && (qi = queue_pop(self->q))) {
+    if (qi->buf == NULL && qi->len == -1) {
+      free(qi);
+      break;
+    }
+    queue_item_free(qi);
+  }
+}
+
+#ifdef _WIN32
+
+struct process *process_start(wchar_t const *const exe_path,
+                              wchar_t const *const envvar_name,
+                              wchar_t const *const envvar_value,
+                              bool const sync,
+                              struct channel *const channel,
+                              struct doorbell *const doorbell) {
   HANDLE in_r = INVALID_HANDLE_VALUE;
   HANDLE in_w = INVALID_HANDLE_VALUE;
   HANDLE in_w_tmp = INVALID_HANDLE_VALUE;
@@ -362,7 +894,7 @@ process_start(wchar_t const *const exe_path, wchar_t const *const envvar_name, w
   CloseHandle(out_w);
   out_w = INVALID_HANDLE_VALUE;
 
-  struct process *r = calloc(1, sizeof(struct process));
+  struct process *const r = process_alloc(sync, channel, doorbell);
   if (!r) {
     CloseHandle(pi.hProcess);
     pi.hProcess = INVALID_HANDLE_VALUE;
@@ -372,19 +904,10 @@ process_start(wchar_t const *const exe_path, wchar_t const *const envvar_name, w
   r->in_w = in_w;
   r->out_r = out_r;
   r->err_r = err_r;
-
-  r->q = queue_init((void **)r->queue_items, 2);
-  if (!r->q) {
+  if (!process_begin(r)) {
+    process_free(r);
     CloseHandle(pi.hProcess);
     pi.hProcess = INVALID_HANDLE_VALUE;
-    free(r);
-    goto cleanup;
-  }
-  if (thrd_create(&r->thread, read_worker, r) != thrd_success) {
-    CloseHandle(pi.hProcess);
-    pi.hProcess = INVALID_HANDLE_VALUE;
-    queue_destroy(r->q);
-    free(r);
     goto cleanup;
   }
   return r;
@@ -468,37 +991,306 @@ void process_finish(struct process *const self) {
     CloseHandle(self->process);
     self->process = INVALID_HANDLE_VALUE;
   }
+  if (!self->sync) {
+    drain(self);
+  }
+  process_free(self);
+}
 
-  // FIXME: we cannot use thrd_join on DLL_PROCESS_DETACH bacause hangs.
-  // thrd_join(self->thread, NULL);
-  // struct queue_item *qi = NULL;
-  // while ((qi = queue_pop_nowait(self->q)))
-  // {
-  //   free(qi);
-  // }
-  thrd_detach(self->thread);
-  struct queue_item *qi = NULL;
-  while ((qi = queue_pop(self->q))) {
-    if (qi->buf == NULL && qi->len == -1) {
-      free(qi);
+void process_close_stderr(struct process *const self) {
+  CloseHandle(self->err_r);
+  self->err_r = INVALID_HANDLE_VALUE;
+}
+
+bool process_isrunning(struct process const *const self) {
+  return WaitForSingleObject(self->process, 0) == WAIT_TIMEOUT;
+}
+
+#else
+
+static char *to_multibyte(wchar_t const *const s) {
+  size_t const len = wcstombs(NULL, s, 0);
+  if (len == (size_t)-1) {
+    return NULL;
+  }
+  char *const r = malloc(len + 1);
+  if (r) {
+    wcstombs(r, s, len + 1);
+  }
+  return r;
+}
+
+// Splits cmdline in place into arguments separated by spaces, double quotes keep spaces in an argument.
+// The returned array points into cmdline.
+static char **split_command_line(char *const cmdline) {
+  size_t n = 0;
+  char **argv = malloc(sizeof(char *) * (strlen(cmdline) / 2 + 2));
+  if (!argv) {
+    return NULL;
+  }
+  char *p = cmdline;
+  while (*p) {
+    while (*p == ' ') {
+      ++p;
+    }
+    if (!*p) {
       break;
     }
-    free(qi);
+    char const end = *p == '"' ? '"' : ' ';
+    if (end == '"') {
+      ++p;
+    }
+    argv[n++] = p;
+    while (*p && *p != end) {
+      ++p;
+    }
+    if (*p) {
+      *p++ = '\0';
+    }
   }
+  argv[n] = NULL;
+  return argv;
+}
 
-  if (self->previous_queue_item) {
-    free(self->previous_queue_item);
-    self->previous_queue_item = NULL;
+// Returns our environment with var, which is "name=value", added or replaced.
+// The strings are not copied.
+static char **build_environment(char *const var) {
+  size_t const name_len = (size_t)(strchr(var, '=') - var) + 1;
+  size_t n = 0;
+  while (environ[n]) {
+    ++n;
   }
-  queue_destroy(self->q);
-  free(self);
+  char **const env = malloc(sizeof(char *) * (n + 2));
+  if (!env) {
+    return NULL;
+  }
+  size_t j = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (strncmp(environ[i], var, name_len) != 0) {
+      env[j++] = environ[i];
+    }
+  }
+  env[j++] = var;
+  env[j] = NULL;
+  return env;
+}
+
+#  if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#    define HAVE_SPAWN_CHDIR 1
+#  endif
+
+// Starts argv[0] with the given standard streams, in the directory of the executable like on Windows.
+static pid_t spawn_child(char *const *const argv, char *const *const env, int const in, int const out) {
+  posix_spawn_file_actions_t actions;
+  if (posix_spawn_file_actions_init(&actions) != 0) {
+    return -1;
+  }
+  pid_t pid = -1;
+  char *path = NULL;
+  // Resolve it before changing the directory, relative paths are relative to ours.
+  bool const has_dir = strchr(argv[0], '/') != NULL;
+  if (has_dir) {
+    path = realpath(argv[0], NULL);
+    if (!path) {
+      goto cleanup;
+    }
+  }
+  if (posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO) != 0 ||
+      posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO) != 0) {
+    goto cleanup;
+  }
+#  ifdef HAVE_SPAWN_CHDIR
+  if (has_dir) {
+    // Cut the file name off temporarily to get the directory.
+    char *const slash = strrchr(path, '/');
+    *slash = '\0';
+    int const err = posix_spawn_file_actions_addchdir_np(&actions, slash == path ? "/" : path);
+    *slash = '/';
+    if (err != 0) {
+      goto cleanup;
+    }
+  }
+#  endif
+  // A bare name is searched in PATH like CreateProcess does.
+  int const err = has_dir ? posix_spawn(&pid, path, &actions, NULL, argv, env)
+                          : posix_spawnp(&pid, argv[0], &actions, NULL, argv, env);
+  if (err != 0) {
+    pid = -1;
+  }
+cleanup:
+  free(path);
+  posix_spawn_file_actions_destroy(&actions);
+  return pid;
+}
+
+static bool make_socketpair(int sv[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    return false;
+  }
+  // Only the duplicated ends are inherited by the child.
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+#  ifdef SO_NOSIGPIPE
+  int const on = 1;
+  setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  setsockopt(sv[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#  endif
+  return true;
+}
+
+// Waits for a child whose stdin has been closed, kills it if it does not exit in time.
+static void reap(pid_t const pid) {
+  struct timespec const interval = {0, 1000000};
+  for (int i = 0; i < EXIT_GRACE_MS; ++i) {
+    pid_t const r = waitpid(pid, NULL, WNOHANG);
+    if (r == pid || (r == -1 && errno != EINTR)) {
+      return;
+    }
+    nanosleep(&interval, NULL);
+  }
+  kill(pid, SIGKILL);
+  while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+  }
+}
+
+// The standard streams of the child are sockets rather than pipes,
+// so that writing to a child that has exited fails instead of raising SIGPIPE
+// and so that a reply can be peeked at by process_readable.
+// stderr is inherited, a closed pipe would kill the child with SIGPIPE as soon as it writes to it.
+struct process *process_start(wchar_t const *const exe_path,
+                              wchar_t const *const envvar_name,
+                              wchar_t const *const envvar_value,
+                              bool const sync,
+                              struct channel *const channel,
+                              struct doorbell *const doorbell) {
+  int in[2] = {-1, -1}, out[2] = {-1, -1};
+  char *cmdline = NULL, *var = NULL;
+  char **argv = NULL, **env = NULL;
+  pid_t pid = -1;
+  struct process *r = NULL;
+
+  cmdline = to_multibyte(exe_path);
+  char *const name = to_multibyte(envvar_name);
+  char *const value = to_multibyte(envvar_value);
+  if (name && value) {
+    size_t const len = strlen(name) + strlen(value) + 2;
+    var = malloc(len);
+    if (var) {
+      snprintf(var, len, "%s=%s", name, value);
+    }
+  }
+  free(name);
+  free(value);
+  if (!cmdline || !var) {
+    goto cleanup;
+  }
+  argv = split_command_line(cmdline);
+  env = build_environment(var);
+  if (!argv || !argv[0] || !env) {
+    goto cleanup;
+  }
+  if (!make_socketpair(in) || !make_socketpair(out)) {
+    goto cleanup;
+  }
+  pid = spawn_child(argv, env, in[0], out[1]);
+  if (pid == -1) {
+    goto cleanup;
+  }
+  close(in[0]);
+  in[0] = -1;
+  close(out[1]);
+  out[1] = -1;
+
+  r = process_alloc(sync, channel, doorbell);
+  if (!r) {
+    goto cleanup;
+  }
+  r->pid = pid;
+  r->in_w = in[1];
+  r->out_r = out[0];
+  if (!process_begin(r)) {
+    process_free(r);
+    r = NULL;
+    goto cleanup;
+  }
+  in[1] = -1;
+  out[0] = -1;
+
+cleanup:
+  for (int i = 0; i < 2; ++i) {
+    if (in[i] != -1) {
+      close(in[i]);
+    }
+    if (out[i] != -1) {
+      close(out[i]);
+    }
+  }
+  if (!r && pid != -1) {
+    // Its stdin is closed now.
+    reap(pid);
+  }
+  free(env);
+  free(argv);
+  free(var);
+  free(cmdline);
+  return r;
+}
+
+void process_finish(struct process *const self) {
+  // The child sees the end of its stdin and exits if it is well-behaved.
+  close(self->in_w);
+  self->in_w = INVALID_PIPE;
+  if (!self->sync) {
+    // Closing the socket would not wake read_worker up if it is blocked on it, shutting it down does.
+    shutdown(self->out_r, SHUT_RD);
+    drain(self);
+  }
+  close(self->out_r);
+  self->out_r = INVALID_PIPE;
+  reap(self->pid);
+  process_free(self);
 }
 
 void process_close_stderr(struct process *const self) {
-  CloseHandle(self->err_r);
-  self->err_r = INVALID_HANDLE_VALUE;
+  // stderr is inherited, see process_start.
+  (void)self;
 }
 
 bool process_isrunning(struct process const *const self) {
-  return WaitForSingleObject(self->process, 0) == WAIT_TIMEOUT;
+  siginfo_t info;
+  info.si_pid = 0;
+  // WNOWAIT leaves the child for process_finish to reap.
+  return waitid(P_PID, (id_t)self->pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+}
+
+#endif
+
+bool process_readable(struct process *const self) {
+  if (self->worker_exited) {
+    return true;
+  }
+  if (!self->sync) {
+    return !queue_empty(self->q);
+  }
+  if (self->doorbell) {
+    return doorbell_reply_ready(self->doorbell) || !process_isrunning(self);
+  }
+  // Read what has arrived so far, process_read would block in the middle of the reply otherwise.
+  if (!self->ready && read_reply(self, false, &self->ready) == READ_FAILED) {
+    // process_read fails right away.
+    self->worker_exited = true;
+  }
+  return self->ready || self->worker_exited;
+}
+
+bool process_issync(struct process const *const self) { return self->sync; }
+
+void process_set_wait_policy(struct process *const self, enum wait_policy const policy, uint32_t const spins) {
+  self->spinner.policy = policy;
+  self->spinner.spins = spins;
+}
+
+void process_get_wait_stats(struct process *const self, struct process_wait_stats *const stats) {
+  stats->spin_succeeded = self->spinner.spin_succeeded;
+  stats->blocked = self->spinner.blocked;
 }
@@ -1,14 +1,60 @@
 #pragma once
 
 #include <stdbool.h>
-#include <windows.h>
+#include <stdint.h>
+#include <wchar.h>
 
+#include "bridge.h"
+
+struct channel;
+struct doorbell;
 struct process;
 
-struct process *
-process_start(wchar_t const *const exe_path, wchar_t const *const envvar_name, wchar_t const *const envvar_value);
+struct process_wait_stats {
+  uint64_t spin_succeeded;
+  uint64_t blocked;
+};
+
+struct process_buffer_stats {
+  // Bytes kept for reuse.
+  size_t pooled;
+  // Bytes of replies that have not been released by process_free_buffer yet.
+  size_t in_use;
+};
+
+// If sync is true, no reader thread is started and process_read reads the reply on the calling thread.
+// A synchronous process must not have more than one request in flight,
+// because nobody drains its stdout while a request is being written.
+// If channel is not NULL, replies may also arrive through it and it must outlive the process.
+// If doorbell is not NULL, channel must not be NULL, every payload goes through the channel
+// and the process behaves as a synchronous one. It must outlive the process too.
+struct process *process_start(wchar_t const *const exe_path,
+                              wchar_t const *const envvar_name,
+                              wchar_t const *const envvar_value,
+                              bool const sync,
+                              struct channel *const channel,
+                              struct doorbell *const doorbell);
 void process_finish(struct process *const self);
 void process_close_stderr(struct process *const self);
+// On success, *buf is owned by the caller and must be released by process_free_buffer.
 int process_read(struct process *const self, void **const buf, size_t *const len);
+// Allocates a buffer that can be released by process_free_buffer, as if it had been read from a child.
+void *process_alloc_buffer(size_t const len);
+void process_free_buffer(void *const buf);
+void process_get_buffer_stats(struct process *const self, struct process_buffer_stats *const stats);
 int process_write(struct process *const self, void const *const buf, size_t const len);
+// Tells the child that a request payload has been placed in the channel.
+int process_write_ref(struct process *const self, uint32_t const offset, uint32_t const size);
+// Writes n framed messages with a single write.
+int process_write_batch(struct process *const self,
+                        void const *const *const bufs,
+                        size_t const *const lens,
+                        size_t const n);
 bool process_isrunning(struct process const *const self);
+bool process_issync(struct process const *const self);
+// Only process_read of an asynchronous process or a process with the doorbell waits according to it.
+void process_set_wait_policy(struct process *const self, enum wait_policy const policy, uint32_t const spins);
+// Must not race with process_read.
+void process_get_wait_stats(struct process *const self, struct process_wait_stats *const stats);
+// Returns true if process_read will not block.
+bool process_readable(struct process *const self);
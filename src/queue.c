@@ -0,0 +1,181 @@
+#include "queue.h"
+
+#include "threads.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define QUEUE_SEGMENT_SIZE 32
+
+struct queue_segment {
+  // Number of items published by the producer.
+  atomic_size_t write;
+  // Only touched by the consumer.
+  size_t read;
+  struct queue_segment *_Atomic next;
+  void *items[QUEUE_SEGMENT_SIZE];
+};
+
+struct queue {
+  // Only touched by the consumer.
+  struct queue_segment *head;
+  // Only touched by the producer.
+  struct queue_segment *tail;
+  // A segment the consumer has finished with, recycled by the producer.
+  struct queue_segment *_Atomic spare;
+  // The consumer parks here only after it has stopped spinning, and the producer takes mtx only when it is parked.
+  // cnd_t already sleeps on a futex on Linux and on a condition variable on Windows,
+  // the doorbell would need a named event for every queue.
+  mtx_t mtx;
+  cnd_t cnd;
+  // The producer and the consumer each hold a reference, whichever releases it last frees the queue.
+  atomic_int refs;
+  atomic_bool waiting;
+  uint8_t padding[3];
+};
+
+static struct queue_segment *queue_segment_create(void) {
+  struct queue_segment *const seg = malloc(sizeof(struct queue_segment));
+  if (!seg) {
+    return NULL;
+  }
+  atomic_init(&seg->write, 0);
+  seg->read = 0;
+  atomic_init(&seg->next, NULL);
+  return seg;
+}
+
+struct queue *queue_init(void) {
+  int mtx_ret = thrd_error;
+  int cnd_ret = thrd_error;
+  struct queue *const q = malloc(sizeof(struct queue));
+  if (!q) {
+    return NULL;
+  }
+  q->head = queue_segment_create();
+  if (!q->head) {
+    goto cleanup;
+  }
+  q->tail = q->head;
+  atomic_init(&q->spare, NULL);
+  atomic_init(&q->refs, 1);
+  atomic_init(&q->waiting, false);
+  mtx_ret = mtx_init(&q->mtx, mtx_plain);
+  if (mtx_ret != thrd_success) {
+    goto cleanup;
+  }
+  cnd_ret = cnd_init(&q->cnd);
+  if (cnd_ret != thrd_success) {
+    goto cleanup;
+  }
+  return q;
+cleanup:
+  if (cnd_ret == thrd_success) {
+    cnd_destroy(&q->cnd);
+  }
+  if (mtx_ret == thrd_success) {
+    mtx_destroy(&q->mtx);
+  }
+  free(q->head);
+  free(q);
+  return NULL;
+}
+
+void queue_retain(struct queue *const q) { atomic_fetch_add_explicit(&q->refs, 1, memory_order_relaxed); }
+
+void queue_release(struct queue *const q) {
+  // Makes what the other side did before its release visible before we free it.
+  if (atomic_fetch_sub_explicit(&q->refs, 1, memory_order_acq_rel) != 1) {
+    return;
+  }
+  struct queue_segment *seg = q->head;
+  while (seg) {
+    struct queue_segment *const next = atomic_load_explicit(&seg->next, memory_order_acquire);
+    free(seg);
+    seg = next;
+  }
+  free(atomic_load_explicit(&q->spare, memory_order_acquire));
+  cnd_destroy(&q->cnd);
+  mtx_destroy(&q->mtx);
+  free(q);
+}
+
+bool queue_push(struct queue *const q, void *item) {
+  struct queue_segment *seg = q->tail;
+  size_t const w = atomic_load_explicit(&seg->write, memory_order_relaxed);
+  if (w == QUEUE_SEGMENT_SIZE) {
+    struct queue_segment *next = atomic_exchange_explicit(&q->spare, NULL, memory_order_acquire);
+    if (next) {
+      atomic_store_explicit(&next->write, 0, memory_order_relaxed);
+      next->read = 0;
+      atomic_store_explicit(&next->next, NULL, memory_order_relaxed);
+    } else {
+      next = queue_segment_create();
+      if (!next) {
+        return false;
+      }
+    }
+    next->items[0] = item;
+    atomic_store_explicit(&next->write, 1, memory_order_relaxed);
+    // Publishes the segment together with its first item.
+    atomic_store_explicit(&seg->next, next, memory_order_release);
+    q->tail = next;
+  } else {
+    seg->items[w] = item;
+    atomic_store_explicit(&seg->write, w + 1, memory_order_release);
+  }
+  // Pairs with the fence in queue_pop, either we see waiting or the consumer sees the item.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&q->waiting, memory_order_relaxed)) {
+    mtx_lock(&q->mtx);
+    cnd_signal(&q->cnd);
+    mtx_unlock(&q->mtx);
+  }
+  return true;
+}
+
+void *queue_pop_nowait(struct queue *const q) {
+  for (;;) {
+    struct queue_segment *const seg = q->head;
+    if (seg->read < atomic_load_explicit(&seg->write, memory_order_acquire)) {
+      return seg->items[seg->read++];
+    }
+    if (seg->read < QUEUE_SEGMENT_SIZE) {
+      return NULL;
+    }
+    struct queue_segment *const next = atomic_load_explicit(&seg->next, memory_order_acquire);
+    if (!next) {
+      return NULL;
+    }
+    // The producer has moved on to next and never looks at seg again.
+    q->head = next;
+    struct queue_segment *const old = atomic_exchange_explicit(&q->spare, seg, memory_order_release);
+    free(old);
+  }
+}
+
+void *queue_pop(struct queue *const q) {
+  void *r = queue_pop_nowait(q);
+  if (r) {
+    return r;
+  }
+  mtx_lock(&q->mtx);
+  atomic_store_explicit(&q->waiting, true, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!(r = queue_pop_nowait(q))) {
+    cnd_wait(&q->cnd, &q->mtx);
+  }
+  atomic_store_explicit(&q->waiting, false, memory_order_relaxed);
+  mtx_unlock(&q->mtx);
+  return r;
+}
+
+bool queue_empty(struct queue *const q) {
+  struct queue_segment *const seg = q->head;
+  if (seg->read < atomic_load_explicit(&seg->write, memory_order_acquire)) {
+    return false;
+  }
+  // A full segment is followed by a non-empty one as soon as it is linked.
+  return seg->read < QUEUE_SEGMENT_SIZE || !atomic_load_explicit(&seg->next, memory_order_acquire);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-producer single-consumer queue between read_worker and the thread that calls process_read.
+// Items are stored in fixed size segments that are chained when the producer gets ahead,
+// so the producer never blocks, otherwise a child that has many replies queued
+// could not drain its stdout while we are still writing requests to its stdin.
+struct queue;
+
+// Returns a queue with one reference, the producer takes another with queue_retain.
+struct queue *queue_init(void);
+void queue_retain(struct queue *const q);
+// Frees the queue when the last reference is released.
+// The producer releases its reference only after it has returned from its last queue_push,
+// which may still wake the consumer after the consumer has already taken the item.
+void queue_release(struct queue *const q);
+// Returns false only if a new segment could not be allocated.
+bool queue_push(struct queue *const q, void *item);
+// Returns NULL if the queue is empty.
+void *queue_pop_nowait(struct queue *const q);
+// Sleeps until an item arrives, polling is left to the caller, see struct spinner.
+void *queue_pop(struct queue *const q);
+bool queue_empty(struct queue *const q);
@@ -0,0 +1,99 @@
+#include "spin.h"
+
+#include "timer.h"
+
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#endif
+
+// Replies that usually take longer than this are not worth polling for.
+#define ADAPTIVE_MAX_WAIT_NS 50000
+// Polls up to this many times the average wait, so that slightly slower replies are still caught.
+#define ADAPTIVE_SPIN_FACTOR 2
+// Weight of the latest wait in the moving average is 1 / 2^ADAPTIVE_SHIFT.
+#define ADAPTIVE_SHIFT 3
+// The clock is more expensive than a poll, read it only every this many iterations.
+#define ADAPTIVE_CLOCK_INTERVAL 16
+
+bool spin_useful(void) {
+  // Every thread that detects it stores the same value, so relaxed ordering is enough.
+  static _Atomic int useful = -1;
+  int r = atomic_load_explicit(&useful, memory_order_relaxed);
+  if (r < 0) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    long const n = (long)si.dwNumberOfProcessors;
+#else
+    long const n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    r = n > 1;
+    atomic_store_explicit(&useful, r, memory_order_relaxed);
+  }
+  return r;
+}
+
+void cpu_relax(void) {
+#ifdef _WIN32
+  YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+void spinner_init(struct spinner *const self, enum wait_policy const policy, uint32_t const spins) {
+  self->policy = policy;
+  self->spins = spins;
+  self->avg_wait_ns = 0;
+}
+
+static void record_wait(struct spinner *const self, uint64_t const ns) {
+  // Only the adaptive policy needs it, but keeping it up to date lets the policy be switched at any time.
+  self->avg_wait_ns = self->avg_wait_ns - (self->avg_wait_ns >> ADAPTIVE_SHIFT) + (ns >> ADAPTIVE_SHIFT);
+}
+
+bool spinner_spin(struct spinner *const self, bool (*const ready)(void *), void *const userdata, uint64_t *const start) {
+  *start = timer_now_ns();
+  if (ready(userdata)) {
+    record_wait(self, 0);
+    return true;
+  }
+  bool spun = false;
+  if (self->policy == WAIT_POLICY_SPIN) {
+    for (uint32_t i = 0; i < self->spins; ++i) {
+      cpu_relax();
+      if (ready(userdata)) {
+        spun = true;
+        break;
+      }
+    }
+  } else if (self->policy == WAIT_POLICY_ADAPTIVE && spin_useful() && self->avg_wait_ns <= ADAPTIVE_MAX_WAIT_NS) {
+    uint64_t const deadline = *start + self->avg_wait_ns * ADAPTIVE_SPIN_FACTOR;
+    for (uint32_t i = 1;; ++i) {
+      cpu_relax();
+      if (ready(userdata)) {
+        spun = true;
+        break;
+      }
+      if (i % ADAPTIVE_CLOCK_INTERVAL == 0 && timer_now_ns() >= deadline) {
+        break;
+      }
+    }
+  }
+  if (spun) {
+    ++self->spin_succeeded;
+    record_wait(self, timer_now_ns() - *start);
+    return true;
+  }
+  ++self->blocked;
+  return false;
+}
+
+void spinner_woke(struct spinner *const self, uint64_t const start, uint64_t const arrived) {
+  uint64_t const end = arrived ? arrived : timer_now_ns();
+  record_wait(self, end > start ? end - start : 0);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bridge.h"
+
+// Decides how long a consumer polls before it goes to sleep, see enum wait_policy.
+struct spinner {
+  enum wait_policy policy;
+  // Iterations for WAIT_POLICY_SPIN.
+  uint32_t spins;
+  // Moving average of how long the recent waits took, for WAIT_POLICY_ADAPTIVE.
+  uint64_t avg_wait_ns;
+  // Waits that ended while polling and waits that had to sleep.
+  uint64_t spin_succeeded;
+  uint64_t blocked;
+};
+
+void spinner_init(struct spinner *const self, enum wait_policy const policy, uint32_t const spins);
+// Polls ready(userdata) according to the policy and returns true once it returns true.
+// Returns false if the caller has to sleep, it must call spinner_woke once it has been woken up.
+bool spinner_spin(struct spinner *const self, bool (*const ready)(void *), void *const userdata, uint64_t *const start);
+// arrived is when the awaited item became ready, or 0 if unknown.
+// Using the time we woke up instead would count the wake-up latency that spinning is meant to avoid.
+void spinner_woke(struct spinner *const self, uint64_t const start, uint64_t const arrived);
+// False on machines where the other side cannot run while we are spinning.
+bool spin_useful(void);
+void cpu_relax(void);
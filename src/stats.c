@@ -0,0 +1,142 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each power of two is split into 2^SUB_BITS buckets, so a bucket is at most 1/2^SUB_BITS of its value wide.
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define BUCKET_COUNT (64 * SUB_COUNT)
+
+struct histogram {
+  _Atomic uint64_t sum;
+  _Atomic uint64_t min;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[BUCKET_COUNT];
+};
+
+struct stats {
+  _Atomic uint64_t counters[STATS_COUNTER_COUNT];
+  struct histogram phases[BRIDGE_PHASE_COUNT];
+};
+
+static atomic_bool g_enabled = false;
+
+static size_t bucket_index(uint64_t const v) {
+  if (v < SUB_COUNT) {
+    return (size_t)v;
+  }
+  unsigned const shift = (unsigned)(63 - __builtin_clzll(v)) - SUB_BITS;
+  return (size_t)(shift + 1) * SUB_COUNT + (size_t)((v >> shift) & (SUB_COUNT - 1));
+}
+
+// Returns the middle of the bucket.
+static uint64_t bucket_value(size_t const i) {
+  if (i < SUB_COUNT) {
+    return i;
+  }
+  unsigned const shift = (unsigned)(i / SUB_COUNT) - 1;
+  uint64_t const low = (uint64_t)(SUB_COUNT + i % SUB_COUNT) << shift;
+  return low + ((UINT64_C(1) << shift) >> 1);
+}
+
+// Other threads may be recording at the same time.
+static void histogram_reset(struct histogram *const h) {
+  atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->min, UINT64_MAX, memory_order_relaxed);
+  atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+  for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+    atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+  }
+}
+
+struct stats *stats_create(void) {
+  struct stats *const r = malloc(sizeof(struct stats));
+  if (!r) {
+    return NULL;
+  }
+  stats_reset(r);
+  return r;
+}
+
+void stats_destroy(struct stats *const self) { free(self); }
+
+void stats_set_enabled(bool const enabled) { atomic_store_explicit(&g_enabled, enabled, memory_order_relaxed); }
+
+bool stats_enabled(void) { return atomic_load_explicit(&g_enabled, memory_order_relaxed); }
+
+void stats_record(struct stats *const self, enum bridge_phase const phase, uint64_t const ns) {
+  if (!self || !stats_enabled()) {
+    return;
+  }
+  struct histogram *const h = &self->phases[phase];
+  atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->buckets[bucket_index(ns)], 1, memory_order_relaxed);
+  uint64_t m = atomic_load_explicit(&h->min, memory_order_relaxed);
+  while (ns < m &&
+         !atomic_compare_exchange_weak_explicit(&h->min, &m, ns, memory_order_relaxed, memory_order_relaxed)) {
+  }
+  m = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (ns > m &&
+         !atomic_compare_exchange_weak_explicit(&h->max, &m, ns, memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+void stats_add(struct stats *const self, enum stats_counter const counter, uint64_t const n) {
+  if (self && stats_enabled()) {
+    atomic_fetch_add_explicit(&self->counters[counter], n, memory_order_relaxed);
+  }
+}
+
+static void histogram_get(struct histogram *const h, struct bridge_latency *const r) {
+  // Updates may race with us, so take the bucket total as the count to keep the percentiles consistent.
+  uint64_t buckets[BUCKET_COUNT];
+  uint64_t count = 0;
+  for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+    buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    count += buckets[i];
+  }
+  memset(r, 0, sizeof(*r));
+  r->count = count;
+  if (!count) {
+    return;
+  }
+  r->min_ns = atomic_load_explicit(&h->min, memory_order_relaxed);
+  r->max_ns = atomic_load_explicit(&h->max, memory_order_relaxed);
+  r->mean_ns = atomic_load_explicit(&h->sum, memory_order_relaxed) / count;
+  static uint64_t const permille[] = {500, 900, 990, 999};
+  uint64_t *const dests[] = {&r->p50_ns, &r->p90_ns, &r->p99_ns, &r->p999_ns};
+  size_t const n = sizeof(dests) / sizeof(dests[0]);
+  size_t t = 0;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKET_COUNT && t < n; ++i) {
+    seen += buckets[i];
+    while (t < n && seen >= (count * permille[t] + 999) / 1000) {
+      uint64_t v = bucket_value(i);
+      // The bucket is wider than the range actually recorded.
+      v = v < r->min_ns ? r->min_ns : v > r->max_ns ? r->max_ns : v;
+      *dests[t++] = v;
+    }
+  }
+}
+
+void stats_get(struct stats *const self, struct bridge_stats *const r) {
+  r->calls = atomic_load_explicit(&self->counters[STATS_CALLS], memory_order_relaxed);
+  r->bytes_in = atomic_load_explicit(&self->counters[STATS_BYTES_IN], memory_order_relaxed);
+  r->bytes_out = atomic_load_explicit(&self->counters[STATS_BYTES_OUT], memory_order_relaxed);
+  r->spawns = atomic_load_explicit(&self->counters[STATS_SPAWNS], memory_order_relaxed);
+  r->respawns = atomic_load_explicit(&self->counters[STATS_RESPAWNS], memory_order_relaxed);
+  for (int i = 0; i < BRIDGE_PHASE_COUNT; ++i) {
+    histogram_get(&self->phases[i], &r->phases[i]);
+  }
+}
+
+void stats_reset(struct stats *const self) {
+  for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+    atomic_store_explicit(&self->counters[i], 0, memory_order_relaxed);
+  }
+  for (int i = 0; i < BRIDGE_PHASE_COUNT; ++i) {
+    histogram_reset(&self->phases[i]);
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bridge.h"
+
+// Counters and latency histograms of one executable, updated by any thread without locks.
+struct stats;
+
+enum stats_counter {
+  STATS_CALLS,
+  STATS_BYTES_IN,
+  STATS_BYTES_OUT,
+  STATS_SPAWNS,
+  STATS_RESPAWNS,
+  STATS_COUNTER_COUNT,
+};
+
+struct stats *stats_create(void);
+void stats_destroy(struct stats *const self);
+void stats_set_enabled(bool const enabled);
+bool stats_enabled(void);
+// Does nothing while disabled.
+void stats_record(struct stats *const self, enum bridge_phase const phase, uint64_t const ns);
+void stats_add(struct stats *const self, enum stats_counter const counter, uint64_t const n);
+// Fills everything but buffers and waits.
+void stats_get(struct stats *const self, struct bridge_stats *const r);
+void stats_reset(struct stats *const self);
@@ -0,0 +1,29 @@
+#include "timer.h"
+
+#ifdef _WIN32
+#  include <stdatomic.h>
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+uint64_t timer_now_ns(void) {
+#ifdef _WIN32
+  // Called from several threads at once, each of them would store the same value.
+  static _Atomic int64_t cached_freq = 0;
+  int64_t freq = atomic_load_explicit(&cached_freq, memory_order_relaxed);
+  if (!freq) {
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    freq = f.QuadPart;
+    atomic_store_explicit(&cached_freq, freq, memory_order_relaxed);
+  }
+  LARGE_INTEGER c;
+  QueryPerformanceCounter(&c);
+  return (uint64_t)(c.QuadPart / freq) * 1000000000 + (uint64_t)(c.QuadPart % freq) * 1000000000 / (uint64_t)freq;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
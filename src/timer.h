@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Monotonic time in nanoseconds, only differences are meaningful.
+uint64_t timer_now_ns(void);
@@ -0,0 +1,260 @@
+#include "trace.h"
+
+#include "threads.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#elif defined(__linux__)
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#else
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+
+// Events per thread, later ones are dropped until the next trace_start.
+#define TRACE_BUFFER_EVENTS 65536
+// Buffers grow by this many events, so a thread that records little does not hold the whole buffer.
+#define TRACE_CHUNK_EVENTS 1024
+
+struct trace_event {
+  uint64_t start;
+  uint64_t end;
+  uint64_t bytes;
+  char const *name;
+  char const *exe_path;
+  size_t exe_path_len;
+  uint32_t padding;
+};
+
+// Only the owner thread writes to it.
+// The events below count are complete, so trace_stop can read them while the owner keeps recording.
+// Chunks are allocated as the events reach them, kept for the next session and freed by trace_exit.
+struct trace_buffer {
+  struct trace_buffer *next;
+  struct trace_event *_Atomic chunks[TRACE_BUFFER_EVENTS / TRACE_CHUNK_EVENTS];
+  uint32_t tid;
+  // The session the events belong to, the owner clears the buffer when a new one starts.
+  _Atomic uint32_t session;
+  atomic_size_t count;
+  _Atomic uint64_t dropped;
+};
+
+static atomic_bool g_active = false;
+static _Atomic uint32_t g_session = 0;
+// Every buffer ever allocated, pushed without a lock.
+static struct trace_buffer *_Atomic g_buffers = NULL;
+// Guards g_path and serializes trace_start / trace_stop.
+static mtx_t g_trace_mutex;
+static char *g_path = NULL;
+// Incremented when the buffers are freed so that threads forget their buffer.
+static _Atomic uint32_t g_epoch = 0;
+
+static _Thread_local struct trace_buffer *t_buffer = NULL;
+static _Thread_local uint32_t t_epoch = 0;
+
+static uint32_t current_tid(void) {
+#ifdef _WIN32
+  return (uint32_t)GetCurrentThreadId();
+#elif defined(__linux__)
+  // The kernel thread id, so traces line up with perf and /proc.
+  return (uint32_t)syscall(SYS_gettid);
+#else
+  // Not an id the OS shows, but unique among the running threads of the process.
+  return (uint32_t)(uintptr_t)pthread_self();
+#endif
+}
+
+static uint32_t current_pid(void) {
+#ifdef _WIN32
+  return (uint32_t)GetCurrentProcessId();
+#else
+  return (uint32_t)getpid();
+#endif
+}
+
+void trace_init(void) { mtx_init(&g_trace_mutex, mtx_plain); }
+
+void trace_exit(void) {
+  trace_stop();
+  mtx_lock(&g_trace_mutex);
+  struct trace_buffer *b = atomic_exchange_explicit(&g_buffers, NULL, memory_order_acq_rel);
+  atomic_fetch_add_explicit(&g_epoch, 1, memory_order_release);
+  while (b) {
+    struct trace_buffer *const next = b->next;
+    for (size_t i = 0; i < TRACE_BUFFER_EVENTS / TRACE_CHUNK_EVENTS; ++i) {
+      free(b->chunks[i]);
+    }
+    free(b);
+    b = next;
+  }
+  mtx_unlock(&g_trace_mutex);
+  mtx_destroy(&g_trace_mutex);
+}
+
+bool trace_enabled(void) { return atomic_load_explicit(&g_active, memory_order_relaxed); }
+
+static struct trace_buffer *get_buffer(void) {
+  uint32_t const epoch = atomic_load_explicit(&g_epoch, memory_order_acquire);
+  if (t_buffer && t_epoch == epoch) {
+    return t_buffer;
+  }
+  struct trace_buffer *const b = calloc(1, sizeof(struct trace_buffer));
+  if (!b) {
+    return NULL;
+  }
+  b->tid = current_tid();
+  b->session = atomic_load_explicit(&g_session, memory_order_acquire);
+  b->next = atomic_load_explicit(&g_buffers, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&g_buffers, &b->next, b, memory_order_release, memory_order_relaxed)) {
+  }
+  t_buffer = b;
+  t_epoch = epoch;
+  return b;
+}
+
+// Returns the chunk that event n goes to, it is published before count covers it.
+static struct trace_event *get_chunk(struct trace_buffer *const b, size_t const n) {
+  struct trace_event *_Atomic *const slot = &b->chunks[n / TRACE_CHUNK_EVENTS];
+  struct trace_event *c = atomic_load_explicit(slot, memory_order_relaxed);
+  if (!c) {
+    c = malloc(TRACE_CHUNK_EVENTS * sizeof(struct trace_event));
+    if (!c) {
+      return NULL;
+    }
+    atomic_store_explicit(slot, c, memory_order_release);
+  }
+  return c;
+}
+
+void trace_record(char const *const name,
+                  char const *const exe_path,
+                  size_t const exe_path_len,
+                  uint64_t const start_ns,
+                  uint64_t const end_ns,
+                  uint64_t const bytes) {
+  if (!trace_enabled()) {
+    return;
+  }
+  struct trace_buffer *const b = get_buffer();
+  if (!b) {
+    return;
+  }
+  uint32_t const session = atomic_load_explicit(&g_session, memory_order_acquire);
+  if (atomic_load_explicit(&b->session, memory_order_relaxed) != session) {
+    atomic_store_explicit(&b->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&b->dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&b->session, session, memory_order_release);
+  }
+  size_t const n = atomic_load_explicit(&b->count, memory_order_relaxed);
+  struct trace_event *const c = n == TRACE_BUFFER_EVENTS ? NULL : get_chunk(b, n);
+  if (!c) {
+    atomic_fetch_add_explicit(&b->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  c[n % TRACE_CHUNK_EVENTS] = (struct trace_event){
+      .name = name,
+      .exe_path = exe_path,
+      .exe_path_len = exe_path_len,
+      .start = start_ns,
+      .end = end_ns,
+      .bytes = bytes,
+  };
+  atomic_store_explicit(&b->count, n + 1, memory_order_release);
+}
+
+bool trace_start(char const *const path) {
+  size_t const len = strlen(path);
+  char *const p = malloc(len + 1);
+  if (!p) {
+    return false;
+  }
+  memcpy(p, path, len + 1);
+  mtx_lock(&g_trace_mutex);
+  free(g_path);
+  g_path = p;
+  // Buffers of the previous session are cleared by their owners on their next event.
+  atomic_fetch_add_explicit(&g_session, 1, memory_order_release);
+  atomic_store_explicit(&g_active, true, memory_order_release);
+  mtx_unlock(&g_trace_mutex);
+  return true;
+}
+
+static void write_json_string(FILE *const fp, char const *const s, size_t const len) {
+  fputc('"', fp);
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char const c = (unsigned char)s[i];
+    if (c == '"' || c == '\\') {
+      fputc('\\', fp);
+      fputc(c, fp);
+    } else if (c < 0x20) {
+      fprintf(fp, "\\u%04x", c);
+    } else {
+      fputc(c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+// Chrome expects microseconds, keep the nanoseconds as the fraction.
+static void write_us(FILE *const fp, uint64_t const ns) {
+  fprintf(fp, "%" PRIu64 ".%03u", ns / 1000, (unsigned)(ns % 1000));
+}
+
+static bool write_trace(char const *const path, uint32_t const session) {
+  FILE *const fp = fopen(path, "wb");
+  if (!fp) {
+    return false;
+  }
+  uint32_t const pid = current_pid();
+  uint64_t dropped = 0;
+  bool first = true;
+  fputs("{\"traceEvents\":[", fp);
+  for (struct trace_buffer *b = atomic_load_explicit(&g_buffers, memory_order_acquire); b; b = b->next) {
+    if (atomic_load_explicit(&b->session, memory_order_acquire) != session) {
+      continue;
+    }
+    size_t const n = atomic_load_explicit(&b->count, memory_order_acquire);
+    dropped += atomic_load_explicit(&b->dropped, memory_order_relaxed);
+    for (size_t i = 0; i < n; ++i) {
+      struct trace_event const *const e =
+          atomic_load_explicit(&b->chunks[i / TRACE_CHUNK_EVENTS], memory_order_acquire) + i % TRACE_CHUNK_EVENTS;
+      fputs(first ? "\n" : ",\n", fp);
+      first = false;
+      fprintf(fp, "{\"name\":\"%s\",\"cat\":\"bridge\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":", e->name, pid, b->tid);
+      write_us(fp, e->start);
+      fputs(",\"dur\":", fp);
+      write_us(fp, e->end > e->start ? e->end - e->start : 0);
+      fputs(",\"args\":{\"exe\":", fp);
+      if (e->exe_path) {
+        write_json_string(fp, e->exe_path, e->exe_path_len);
+      } else {
+        fputs("null", fp);
+      }
+      fprintf(fp, ",\"bytes\":%" PRIu64 "}}", e->bytes);
+    }
+  }
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":%" PRIu64 "}}\n", dropped);
+  bool const ok = !ferror(fp);
+  return fclose(fp) == 0 && ok;
+}
+
+bool trace_stop(void) {
+  mtx_lock(&g_trace_mutex);
+  if (!atomic_load_explicit(&g_active, memory_order_acquire)) {
+    mtx_unlock(&g_trace_mutex);
+    return false;
+  }
+  atomic_store_explicit(&g_active, false, memory_order_release);
+  bool const ok = write_trace(g_path, atomic_load_explicit(&g_session, memory_order_acquire));
+  free(g_path);
+  g_path = NULL;
+  mtx_unlock(&g_trace_mutex);
+  return ok;
+}
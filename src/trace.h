@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Records spans into per-thread buffers and writes them as Chrome trace-event JSON.
+// Recording takes no lock, only starting and stopping do.
+
+void trace_init(void);
+void trace_exit(void);
+// Discards the spans recorded so far and starts recording, the file is written by trace_stop.
+bool trace_start(char const *const path);
+// Returns false if nothing was being recorded or the file could not be written.
+bool trace_stop(void);
+bool trace_enabled(void);
+// name must be a string literal, exe_path must stay valid until trace_stop.
+void trace_record(char const *const name,
+                  char const *const exe_path,
+                  size_t const exe_path_len,
+                  uint64_t const start_ns,
+                  uint64_t const end_ns,
+                  uint64_t const bytes);